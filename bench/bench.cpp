@@ -0,0 +1,187 @@
+/**
+ * Benchmark harness, runs each benchmark script with the atto
+ * executable a number of times and reports wall time and peak RSS.
+ *
+ * Usage: atto_bench [-n runs] [--json file] [--atto path] [script.at...]
+ * Without scripts all *.at files in the bench directory are run.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "stats.hpp"
+
+namespace fs = std::filesystem;
+using bench::ms;
+using bench::percentile;
+
+namespace {
+
+struct Run {
+  double seconds;
+  long maxRssKb;
+};
+
+struct Result {
+  std::string name;
+  std::vector<double> seconds; // sorted
+  long maxRssKb;
+  bool failed;
+};
+
+/// run atto with script once, output is thrown away
+bool runOnce(const fs::path& atto, const fs::path& script, Run& run)
+{
+  // errors goes to stderr, kept to see if there were any
+  std::unique_ptr<std::FILE, int(*)(std::FILE*)> errors{
+    std::tmpfile(), &std::fclose};
+  if (!errors)
+    return false;
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0)
+    return false;
+  if (pid == 0) {
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(fileno(errors.get()), STDERR_FILENO);
+    execl(atto.c_str(), atto.c_str(), script.c_str(),
+          static_cast<char*>(nullptr));
+    _exit(127);
+  }
+
+  int status = 0;
+  struct rusage usage{};
+  if (wait4(pid, &status, 0, &usage) != pid)
+    return false;
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  run.seconds = elapsed.count();
+  run.maxRssKb = usage.ru_maxrss;
+  // atto exits with the value of main, so the exit code can't tell
+  // an error from a main that returns 1, but only errors writes stderr
+  struct stat errStat{};
+  if (fstat(fileno(errors.get()), &errStat) != 0 || errStat.st_size != 0)
+    return false;
+  return WIFEXITED(status) && WEXITSTATUS(status) != 127;
+}
+
+void printTable(const std::vector<Result>& results, int runs)
+{
+  std::cout << "runs per benchmark: " << runs << "\n"
+            << std::left << std::setw(16) << "benchmark"
+            << std::right << std::setw(12) << "min ms"
+            << std::setw(12) << "median ms"
+            << std::setw(12) << "p99 ms"
+            << std::setw(14) << "peak RSS kB" << '\n';
+  for (const auto& r : results) {
+    std::cout << std::left << std::setw(16) << r.name << std::right;
+    if (r.failed) {
+      std::cout << std::setw(12) << "FAILED" << '\n';
+      continue;
+    }
+    std::cout << std::setw(12) << ms(r.seconds.front())
+              << std::setw(12) << ms(percentile(r.seconds, 0.5))
+              << std::setw(12) << ms(percentile(r.seconds, 0.99))
+              << std::setw(14) << r.maxRssKb << '\n';
+  }
+}
+
+void writeJson(std::ostream& out, const std::vector<Result>& results,
+               int runs)
+{
+  out << "{\n  \"runs\": " << runs << ",\n  \"benchmarks\": [\n";
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const auto& r = results[i];
+    out << "    {\"name\": \"" << r.name << "\", "
+        << "\"failed\": " << (r.failed ? "true" : "false");
+    if (!r.failed)
+      out << ", \"min_ms\": " << ms(r.seconds.front())
+          << ", \"median_ms\": " << ms(percentile(r.seconds, 0.5))
+          << ", \"p99_ms\": " << ms(percentile(r.seconds, 0.99))
+          << ", \"peak_rss_kb\": " << r.maxRssKb;
+    out << "}" << (i + 1 < results.size() ? "," : "") << '\n';
+  }
+  out << "  ]\n}\n";
+}
+
+void printHelp()
+{
+  std::cout <<
+    "Usage:\n" <<
+    " atto_bench [options] [script.at...]\n" <<
+    " -n runs        times to run each script, default 10\n" <<
+    " --json file    also write the results as json to file, - for stdout\n" <<
+    " --atto path    the atto executable to benchmark\n" <<
+    " -h             display this help\n" <<
+    "Without scripts, all scripts in " << ATTO_BENCH_DIR << " are run\n";
+}
+
+} // namespace
+
+int main(int argc, const char *argv[])
+{
+  int runs = 10;
+  std::string jsonPath;
+  fs::path atto = ATTO_BENCH_EXE;
+  std::vector<fs::path> scripts;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "-n" && i + 1 < argc)
+      runs = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--json" && i + 1 < argc)
+      jsonPath = argv[++i];
+    else if (arg == "--atto" && i + 1 < argc)
+      atto = argv[++i];
+    else if (arg.substr(0, 1) == "-") {
+      printHelp();
+      return arg == "-h" ? 0 : 1;
+    } else
+      scripts.emplace_back(arg);
+  }
+
+  if (scripts.empty()) {
+    for (const auto& entry : fs::directory_iterator(ATTO_BENCH_DIR))
+      if (entry.path().extension() == ".at")
+        scripts.emplace_back(entry.path());
+    std::sort(scripts.begin(), scripts.end());
+  }
+
+  std::vector<Result> results;
+  bool anyFailed = false;
+  for (const auto& script : scripts) {
+    Result result{script.stem().string(), {}, 0, false};
+    for (int i = 0; i < runs && !result.failed; ++i) {
+      Run run{};
+      result.failed = !runOnce(atto, script, run);
+      result.seconds.emplace_back(run.seconds);
+      result.maxRssKb = std::max(result.maxRssKb, run.maxRssKb);
+    }
+    std::sort(result.seconds.begin(), result.seconds.end());
+    anyFailed = anyFailed || result.failed;
+    results.emplace_back(std::move(result));
+  }
+
+  printTable(results, runs);
+  if (jsonPath == "-")
+    writeJson(std::cout, results, runs);
+  else if (!jsonPath.empty()) {
+    std::ofstream out(jsonPath);
+    writeJson(out, results, runs);
+  }
+  return anyFailed ? 1 : 0;
+}
@@ -0,0 +1,105 @@
+#include <random>
+#include <sstream>
+#include <vector>
+#include "gen_module.hpp"
+
+namespace bench {
+
+namespace {
+
+class Generator {
+  std::mt19937 _rand;
+  std::stringstream _code;
+  std::size_t _tokens;
+  // the number of params of every function generated so far
+  std::vector<int> _arities;
+
+  int pick(int n) {
+    return std::uniform_int_distribution<int>(0, n - 1)(_rand);
+  }
+
+  void token(const std::string& tok) {
+    _code << tok << ' ';
+    ++_tokens;
+  }
+
+  void expr(int params, int depth) {
+    // leafs when deep enough
+    int kind = depth >= 4 ? pick(3) : pick(9);
+    switch (kind) {
+    case 0:
+      token(std::to_string(pick(1000)));
+      break;
+    case 1:
+      if (params > 0) {
+        token("p" + std::to_string(pick(params)));
+        break;
+      }
+      [[fallthrough]];
+    case 2:
+      token("\"s" + std::to_string(pick(100)) + "\"");
+      break;
+    case 3: case 4: {
+      static const char* binary[] = {"+", "-", "*", "=", "fuse", "pair"};
+      token(binary[pick(6)]);
+      expr(params, depth + 1);
+      expr(params, depth + 1);
+    } break;
+    case 5: {
+      static const char* unary[] = {"head", "tail", "len", "str"};
+      token(unary[pick(4)]);
+      expr(params, depth + 1);
+    } break;
+    case 6:
+      token("if");
+      expr(params, depth + 1);
+      expr(params, depth + 1);
+      expr(params, depth + 1);
+      break;
+    default: {
+      if (_arities.empty()) {
+        token("null");
+        break;
+      }
+      // call one of the functions defined earlier
+      auto fn = static_cast<std::size_t>(pick(
+        static_cast<int>(_arities.size())));
+      token("f" + std::to_string(fn));
+      for (int i = 0; i < _arities[fn]; ++i)
+        expr(params, depth + 1);
+    }
+    }
+  }
+
+public:
+  explicit Generator(unsigned seed) :
+    _rand{seed}, _code{}, _tokens{0}, _arities{}
+  {}
+
+  GeneratedModule generate(std::size_t tokens) {
+    while (_tokens < tokens) {
+      int params = pick(4);
+      token("fn");
+      token("f" + std::to_string(_arities.size()));
+      for (int i = 0; i < params; ++i)
+        token("p" + std::to_string(i));
+      token("is");
+      _code << "\n\t";
+      token("#");
+      token("\"generated\"");
+      expr(params, 0);
+      _code << "\n\n";
+      _arities.push_back(params);
+    }
+    return GeneratedModule{_code.str(), _tokens, _arities.size()};
+  }
+};
+
+} // namespace
+
+GeneratedModule generateModule(std::size_t tokens, unsigned seed)
+{
+  return Generator{seed}.generate(tokens);
+}
+
+} // namespace bench
@@ -0,0 +1,28 @@
+#ifndef ATTO_BENCH_GEN_MODULE_H
+#define ATTO_BENCH_GEN_MODULE_H
+
+#include <cstddef>
+#include <string>
+
+namespace bench {
+
+/// @brief A synthetic atto module
+struct GeneratedModule {
+  std::string code;
+  std::size_t tokens;
+  std::size_t funcs;
+};
+
+/**
+ * @brief Generate a module with roughly the given number of tokens.
+ * Functions take 0 to 3 params, their bodies mixes literals, core
+ * functions, if and calls to the functions defined before them.
+ *
+ * @param tokens About how many tokens the module should have
+ * @param seed Same seed gives the same module
+ */
+GeneratedModule generateModule(std::size_t tokens, unsigned seed = 1);
+
+} // namespace bench
+
+#endif // ATTO_BENCH_GEN_MODULE_H
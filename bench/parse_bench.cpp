@@ -0,0 +1,380 @@
+/**
+ * Lexer and parser throughput on generated modules.
+ *
+ * Usage: atto_parse_bench [-n runs] [-t tokens]... [--json file]
+ *        atto_parse_bench -t tokens --write file.at
+ *        atto_parse_bench --verify
+ * Times lex, parse and Isolate::module separately for each module size,
+ * loading the tokens from ModuleCache instead of lex, and completing
+ * function names as the REPL does.
+ * --verify instead checks that lex gives the same tokens and errors
+ * as lexScalar.
+ */
+
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "gen_module.hpp"
+#include "stats.hpp"
+#include "errors.hpp"
+#include "lex.hpp"
+#include "parser.hpp"
+#include "modules.hpp"
+#include "cache.hpp"
+#include "isolate.hpp"
+
+namespace fs = std::filesystem;
+using namespace atto;
+
+namespace {
+
+struct Result {
+  std::string phase;
+  std::size_t tokens, funcs;
+  std::vector<double> seconds; // sorted
+  /// lookups per run, if not 0 only the time per lookup is reported
+  std::size_t lookups = 0;
+};
+
+/// time fn runs times, setup is run before each time but not timed
+std::vector<double> measure(int runs,
+                            const std::function<void(int)>& setup,
+                            const std::function<void(int)>& fn)
+{
+  std::vector<double> seconds;
+  for (int i = 0; i < runs; ++i) {
+    setup(i);
+    auto start = std::chrono::steady_clock::now();
+    fn(i);
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    seconds.emplace_back(elapsed.count());
+  }
+  std::sort(seconds.begin(), seconds.end());
+  return seconds;
+}
+
+/// microseconds per lookup of r at percentile p
+double usPerLookup(const Result& r, double p)
+{
+  return bench::percentile(r.seconds, p) * 1e6 /
+    static_cast<double>(r.lookups);
+}
+
+double perSec(std::size_t count, const std::vector<double>& seconds)
+{
+  auto median = bench::percentile(seconds, 0.5);
+  return median > 0.0 ? static_cast<double>(count) / median : 0.0;
+}
+
+void printTable(const std::vector<Result>& results, int runs)
+{
+  std::cout << "runs per measurement: " << runs << "\n"
+            << std::left << std::setw(14) << "phase"
+            << std::right << std::setw(10) << "tokens"
+            << std::setw(8) << "funcs"
+            << std::setw(12) << "min ms"
+            << std::setw(12) << "median ms"
+            << std::setw(14) << "tokens/s"
+            << std::setw(12) << "funcs/s" << '\n';
+  std::cout << std::fixed << std::setprecision(0);
+  for (const auto& r : results) {
+    if (r.lookups) {
+      std::cout << std::left << std::setw(14) << r.phase << std::right
+                << std::setprecision(2)
+                << "min " << usPerLookup(r, 0.0)
+                << " us, median " << usPerLookup(r, 0.5)
+                << " us per lookup\n" << std::setprecision(0);
+      continue;
+    }
+    std::cout << std::left << std::setw(14) << r.phase << std::right
+              << std::setw(10) << r.tokens
+              << std::setw(8) << r.funcs
+              << std::setw(12) << bench::ms(r.seconds.front())
+              << std::setw(12) << bench::ms(bench::percentile(r.seconds, 0.5))
+              << std::setw(14) << perSec(r.tokens, r.seconds)
+              << std::setw(12) << perSec(r.funcs, r.seconds) << '\n';
+  }
+}
+
+void writeJson(std::ostream& out, const std::vector<Result>& results,
+               int runs)
+{
+  out << std::fixed << std::setprecision(0)
+      << "{\n  \"runs\": " << runs << ",\n  \"measurements\": [\n";
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const auto& r = results[i];
+    out << "    {\"phase\": \"" << r.phase << "\"";
+    if (r.lookups) {
+      out << std::setprecision(3)
+          << ", \"lookups\": " << r.lookups
+          << ", \"min_us_per_lookup\": " << usPerLookup(r, 0.0)
+          << ", \"median_us_per_lookup\": " << usPerLookup(r, 0.5)
+          << std::setprecision(0);
+    } else {
+      out << ", \"tokens\": " << r.tokens
+          << ", \"funcs\": " << r.funcs
+          << ", \"min_ms\": " << bench::ms(r.seconds.front())
+          << ", \"median_ms\": " << bench::ms(bench::percentile(r.seconds, 0.5))
+          << ", \"tokens_per_sec\": " << perSec(r.tokens, r.seconds)
+          << ", \"funcs_per_sec\": " << perSec(r.funcs, r.seconds);
+    }
+    out << "}" << (i + 1 < results.size() ? "," : "") << '\n';
+  }
+  out << "  ]\n}\n";
+}
+
+/// lex code with both lex and lexScalar
+/// @return The first difference, empty if they agree
+std::string lexDiff(const std::string& code)
+{
+  auto run = [](void (*lexFn)(Module&, std::size_t), Module& mod) {
+    try {
+      lexFn(mod, 0);
+    } catch (SyntaxError& e) {
+      return std::string(e.what()) + " at " + std::to_string(e.line()) +
+        ":" + std::to_string(e.col());
+    }
+    return std::string{};
+  };
+  Module fast(code), scalar(code);
+  auto fastErr = run(lex, fast), scalarErr = run(lexScalar, scalar);
+  if (fastErr != scalarErr)
+    return "error '" + fastErr + "', lexScalar '" + scalarErr + "'";
+
+  const auto &fastToks = fast.tokens(), &scalarToks = scalar.tokens();
+  for (std::size_t i = 0; i < fastToks.size() && i < scalarToks.size(); ++i) {
+    if (fastToks.type(i) != scalarToks.type(i) ||
+        fastToks.symbol(i) != scalarToks.symbol(i) ||
+        fastToks.offset(i) != scalarToks.offset(i))
+    {
+      auto a = fast.token(i), b = scalar.token(i);
+      return "token " + std::to_string(i) + " '" + std::string(a.ident()) +
+        "' at " + std::to_string(a.offset()) + ", lexScalar '" +
+        std::string(b.ident()) + "' at " + std::to_string(b.offset());
+    }
+  }
+  if (fastToks.size() != scalarToks.size())
+    return std::to_string(fastToks.size()) + " tokens, lexScalar " +
+      std::to_string(scalarToks.size());
+  return {};
+}
+
+/// random source, mostly garbage with runs long enough to take
+/// the vector paths in lex
+std::string randomSource(std::mt19937& rng)
+{
+  static const std::string chars(
+    " \t\n\r\v\"\\n0123456789abzAZ_-#+.(\0\xC3", 31);
+  static const std::string runs[] = {
+    " ", "\n", "abcdefghijklmnopqrstuvwxyz-_ABC", "0123456789", "s\\n ",
+    "\r\n"
+  };
+  std::string code;
+  auto len = std::uniform_int_distribution<int>(0, 200)(rng);
+  while (static_cast<int>(code.size()) < len) {
+    if (rng() % 4 == 0) {
+      auto& run = runs[rng() % std::size(runs)];
+      for (auto n = rng() % 40; n > 0; --n)
+        code += run[n % run.size()];
+    } else
+      code += chars[rng() % chars.size()];
+  }
+  return code;
+}
+
+/// @return 0 if lex and lexScalar agree on all sources
+int verifyLex(const std::vector<std::size_t>& sizes)
+{
+  std::vector<std::string> sources = {
+    "", "\"", "\"\"", "fn main is 1", "fn main x is\r\n  x\r\n",
+    "\"a\\nb\"", "\"\\\nn\"", "\"\\\r\nn\"", "\"abc", "\"a\\",
+    "12a", "a.b", "\"\\q\"", "\"\n\"\n1", std::string("\"x\0y\"", 5),
+    std::string("1 \0 2", 5), " \t\v\f 1\n\n  2\r3",
+    "\"" + std::string(100, 'x') + "\n" + std::string(50, ' ') + "\"",
+    std::string(70, 'a') + " " + std::string(70, '1') + std::string(70, '\n')
+  };
+  for (auto size : sizes)
+    sources.emplace_back(bench::generateModule(size).code);
+  std::mt19937 rng(1);
+  for (int i = 0; i < 100000; ++i)
+    sources.emplace_back(randomSource(rng));
+
+  for (const auto& code : sources) {
+    auto diff = lexDiff(code);
+    if (!diff.empty()) {
+      std::cout << "lex differs from lexScalar: " << diff << "\nsource:\n";
+      for (char c : code.substr(0, 400))
+        if (std::isprint(static_cast<unsigned char>(c)) || c == '\n')
+          std::cout << c;
+        else
+          std::cout << "\\x" << std::hex << (static_cast<int>(c) & 0xFF)
+                    << std::dec;
+      std::cout << '\n';
+      return 1;
+    }
+  }
+  std::cout << "lex and lexScalar agree on " << sources.size()
+            << " sources\n";
+  return 0;
+}
+
+void printHelp()
+{
+  std::cout <<
+    "Usage:\n" <<
+    " atto_parse_bench [options]\n" <<
+    " -n runs        times to measure each phase, default 5\n" <<
+    " -t tokens      module size to generate, may be repeated\n" <<
+    "                default 10000, 100000 and 1000000\n" <<
+    " --json file    also write the results as json to file, - for stdout\n" <<
+    " --write file   only write the generated module to file\n" <<
+    " --verify       check lex against lexScalar, no timings\n" <<
+    " -h             display this help\n";
+}
+
+} // namespace
+
+int main(int argc, const char *argv[])
+{
+  int runs = 5;
+  std::vector<std::size_t> sizes;
+  std::string jsonPath, writePath;
+  bool verify = false;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "-n" && i + 1 < argc)
+      runs = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "-t" && i + 1 < argc)
+      sizes.emplace_back(std::stoul(argv[++i]));
+    else if (arg == "--json" && i + 1 < argc)
+      jsonPath = argv[++i];
+    else if (arg == "--write" && i + 1 < argc)
+      writePath = argv[++i];
+    else if (arg == "--verify")
+      verify = true;
+    else {
+      printHelp();
+      return arg == "-h" ? 0 : 1;
+    }
+  }
+  if (sizes.empty())
+    // the largest one catches parse times that are not linear
+    sizes = {10000, 100000, 1000000};
+
+  if (!writePath.empty()) {
+    std::ofstream out(writePath);
+    out << bench::generateModule(sizes.back()).code;
+    return out ? 0 : 1;
+  }
+
+  if (verify)
+    return verifyLex(sizes);
+
+  // generated code calls into core
+  auto cacheDir = fs::temp_directory_path() / "atto_parse_bench_cache";
+  ModuleCache::setDirectory("");
+  Isolate isolate;
+  Isolate::Use use(isolate);
+  // parse every body, as if they were all called
+  isolate.setParseMode(ParseMode::Eager);
+  isolate.module("__core__", ATTO_CORE_PATH);
+
+  std::vector<Result> results;
+  for (auto size : sizes) {
+    auto gen = bench::generateModule(size);
+    std::unique_ptr<Module> mod;
+
+    results.push_back({"lex", gen.tokens, gen.funcs, measure(runs,
+      [&](int) { mod = std::make_unique<Module>(gen.code); },
+      [&](int) { lex(*mod); })});
+
+    results.push_back({"lex-scalar", gen.tokens, gen.funcs, measure(runs,
+      [&](int) { mod = std::make_unique<Module>(gen.code); },
+      [&](int) { lexScalar(*mod); })});
+
+    results.push_back({"parse", gen.tokens, gen.funcs, measure(runs,
+      [&](int) {
+        mod = std::make_unique<Module>(gen.code);
+        lex(*mod);
+      },
+      [&](int) { parse(*mod); })});
+    mod.reset();
+
+    // the whole load, from reading the file to parsed functions
+    auto path = fs::temp_directory_path() /
+      ("atto_parse_bench_" + std::to_string(size) + ".at");
+    std::ofstream(path) << gen.code;
+    ModuleCache::setDirectory("");
+    results.push_back({"module", gen.tokens, gen.funcs, measure(runs,
+      [](int) {},
+      [&](int run) {
+        isolate.module("bench_" + std::to_string(size) + "_" +
+                       std::to_string(run), path);
+      })});
+
+    // bodies parsed when first called, here none of them
+    isolate.setParseMode(ParseMode::Lazy);
+    results.push_back({"module-lazy", gen.tokens, gen.funcs, measure(runs,
+      [](int) {},
+      [&](int run) {
+        isolate.module("lazy_" + std::to_string(size) + "_" +
+                       std::to_string(run), path);
+      })});
+    isolate.setParseMode(ParseMode::Eager);
+
+    // 100 presses on Tab in the REPL, with all of the above loaded
+    constexpr int Presses = 100;
+    results.push_back({"complete", 0, 0, measure(runs,
+      [](int) {},
+      [&](int) {
+        std::size_t found = 0;
+        for (int i = 0; i < Presses; ++i)
+          found += isolate.funcNames("f" + std::to_string(i)).size();
+        if (found == 0)
+          std::cerr << "no functions to complete\n";
+      }), Presses});
+
+    // tokens and outline from cache, instead of lex and outline
+    ModuleCache::setDirectory(cacheDir);
+    Outline defs;
+    mod = std::make_unique<Module>(path);
+    lex(*mod);
+    ModuleCache::store(*mod, outline(*mod));
+    mod = std::make_unique<Module>(path);
+    // small modules are not cached
+    if (ModuleCache::load(*mod, defs)) {
+      results.push_back({"cache-load", gen.tokens, gen.funcs, measure(runs,
+        [&](int) { mod = std::make_unique<Module>(path); },
+        [&](int) { ModuleCache::load(*mod, defs); })});
+
+      results.push_back({"module-cached", gen.tokens, gen.funcs,
+        measure(runs, [](int) {}, [&](int run) {
+          isolate.module("cached_" + std::to_string(size) + "_" +
+                         std::to_string(run), path);
+        })});
+    }
+    mod.reset();
+    fs::remove(path);
+  }
+
+  fs::remove_all(cacheDir);
+
+  printTable(results, runs);
+  if (jsonPath == "-")
+    writeJson(std::cout, results, runs);
+  else if (!jsonPath.empty()) {
+    std::ofstream out(jsonPath);
+    writeJson(out, results, runs);
+  }
+  return 0;
+}
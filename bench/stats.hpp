@@ -0,0 +1,33 @@
+#ifndef ATTO_BENCH_STATS_H
+#define ATTO_BENCH_STATS_H
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+/// @brief Nearest rank percentile
+/// @param sorted Samples in ascending order
+/// @param p The percentile as a fraction, 0.5 is the median
+inline double percentile(const std::vector<double>& sorted, double p)
+{
+  if (sorted.empty()) return 0.0;
+  auto rank = static_cast<std::size_t>(std::ceil(p * sorted.size()));
+  return sorted[std::clamp<std::size_t>(rank, 1, sorted.size()) - 1];
+}
+
+/// @brief Format seconds as milliseconds with 2 decimals
+inline std::string ms(double seconds)
+{
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(2) << seconds * 1000.0;
+  return ss.str();
+}
+
+} // namespace bench
+
+#endif // ATTO_BENCH_STATS_H
@@ -1,80 +1,83 @@
+#include <algorithm>
 #include <vector>
 #include "ast.hpp"
+#include "cache.hpp"
 #include "parser.hpp"
+#include "compiler.hpp"
+#include "isolate.hpp"
+#include "modules.hpp"
 
-#define DEBUG(x) do { std::cerr << x; } while (0)
-//#define DEBUG(x)
+//#define DEBUG(x) do { std::cerr << x; } while (0)
+#define DEBUG(x)
 
 using namespace atto;
 
-AstBase::AstBase(const Token& tok, LangType type) :
-  _tok{tok}, _type{type}
+AstArena::AstArena() :
+  _blocks{}, _blockUsed{BlockSize}, _blockBytes{0}, _nodes{}
 {}
 
-AstBase::AstBase(
-  const Token& tok,
-  LangType type,
-  std::vector<AstBasePtr>& children
-) :
-  _tok{tok}, _type{type}, _children{std::move(children)}
-{}
-
-/*AstBase::AstBase(const AstBase& other) :
-  _tok{other._tok}, _type{other._type}, _children{other._children}
-{}*/
+AstArena::~AstArena()
+{
+  // the memory goes with the blocks, but values may own strings
+  for (auto node : _nodes)
+    node->~AstBase();
+}
 
-AstBase::AstBase(AstBase&& rhs) :
-  _tok{std::move(rhs._tok)},
-  _type{std::move(rhs._type)},
-  _children{std::move(rhs._children)}
-{}
+void* AstArena::alloc(std::size_t size, std::size_t align)
+{
+  if (size > BlockSize / 4) {
+    // a long body, give it its own block and keep filling the current
+    auto pos = _blocks.empty() ? _blocks.end() : _blocks.end() - 1;
+    _blockBytes += size;
+    return _blocks.emplace(pos, new char[size])->get();
+  }
+  auto offset = (_blockUsed + align - 1) & ~(align - 1);
+  if (offset + size > BlockSize) {
+    _blocks.emplace_back(new char[BlockSize]);
+    _blockBytes += BlockSize;
+    offset = 0;
+  }
+  _blockUsed = offset + size;
+  return _blocks.back().get() + offset;
+}
 
-/*AstBase&
-AstBase::operator=(const AstBase& other) {
-  *const_cast<Token*>(&_tok) = other._tok;
-  _type = other._type;
-  _children = other._children;
-  return *this;
-}*/
+AstChildren AstArena::link(const AstBase* const* children, std::size_t count)
+{
+  // such as a call without arguments
+  if (count == 0)
+    return {this, nullptr, 0};
+  // next to the nodes, which are made just before their parent
+  auto ids = static_cast<NodeId*>(
+    alloc(count * sizeof(NodeId), alignof(NodeId)));
+  for (std::size_t i = 0; i < count; ++i)
+    ids[i] = children[i]->nodeId();
+  return {this, ids, static_cast<std::uint32_t>(count)};
+}
 
-AstBase&
-AstBase::operator=(AstBase&& rhs) {
-  *const_cast<Token*>(&_tok) = std::move(rhs._tok);
-  _type = std::move(rhs._type);
-  _children = std::move(rhs._children);
-  return *this;
+std::size_t AstArena::memoryUsage() const
+{
+  return _blockBytes +
+    _nodes.capacity() * sizeof(AstBase*);
 }
 
+// --------------------------------------------
+
+AstBase::AstBase(const Token& tok, LangType type, AstChildren children) :
+  _tok{tok}, _type{type}, _nodeId{0}, _children{children}
+{}
+
+AstBase::~AstBase() {}
+
 const Token&
 AstBase::token() const { return _tok; }
 
 LangType AstBase::type() const { return _type; }
 
-const std::vector<AstBasePtr>&
-AstBase::children() const {
-  return _children;
-}
-
-void AstBase::addChildren(std::vector<AstBasePtr> children)
-{
-  for (auto& child : children)
-    _children.emplace_back(std::move(child));
-}
-
 const AstBase&
 AstBase::operator[](std::size_t idx) const {
   return *_children[idx];
 }
 
-// static
-AstBase
-AstBase::mkFailed()
-{
-  std::vector<AstBasePtr> children;
-  auto tok = Token::mkFailure();
-  return AstBase(tok, LangType::__Failure, children);
-}
-
 // --------------------------------------------
 
 AstValue::AstValue(
@@ -85,16 +88,6 @@ AstValue::AstValue(
   _vlu{value}
 {}
 
-AstValue::AstValue(AstValue&& rhs) :
-  AstBase{std::move(rhs)}, _vlu{std::move(rhs._vlu)}
-{}
-
-AstValue& AstValue::operator=(AstValue&& rhs) {
-  AstBase::operator=(std::move(rhs));
-  *const_cast<Value*>(&_vlu) = rhs._vlu;
-  return *this;
-}
-
 const Value& AstValue::value() const { return _vlu; }
 
 // -------------------------------------------------------------
@@ -107,110 +100,123 @@ AstIdent::AstIdent(
   _localIdx{localIdx}
 {}
 
-/*AstIdent::AstIdent(const AstIdent& other):
-  AstBase{other}, _localIdx{other._localIdx}
-{}*/
-
-AstIdent::AstIdent(AstIdent&& rhs) :
-  AstBase{std::move(rhs)}, _localIdx{std::move(rhs._localIdx)}
-{}
-
-/*AstIdent& AstIdent::operator=(const AstIdent& other) {
-  AstBase::operator=(other);
-  _localIdx = other._localIdx;
-  return *this;
-}*/
-
-AstIdent& AstIdent::operator=(AstIdent&& rhs) {
-  AstBase::operator=(std::move(rhs));
-  _localIdx = std::move(rhs._localIdx);
-  return *this;
-}
-
 std::size_t AstIdent::localIdx() const { return _localIdx; }
 
 // ------------------------------------------------------
 
 AstFunc::AstFunc(
   const Token& tok,
-  FuncParams args
+  FuncParams args,
+  const Module& module
 ) :
   AstBase{tok, LangType::Fn},
-  _args{args}
+  _args{args}, _module{module}, _id{0}, _code{}, _codeEpoch{0},
+  _bodyTok{0}, _bodyVersion{0}, _bodyParsed{true}, _frozen{false}
 {}
 
-/*AstFunc::AstFunc(const AstFunc& other) :
-  AstBase{other}, _args{other._args}
-{}*/
+const FuncParams& AstFunc::args() const {
+  return _args;
+}
 
-AstFunc::AstFunc(AstFunc&& rhs) :
-  AstBase{std::move(rhs)}, _args{std::move(_args)}
-{}
+std::string_view AstFunc::fnName() const
+{
+  return _tok.ident();
+}
 
-/*AstFunc& AstFunc::operator=(const AstFunc& other) {
-  AstBase::operator=(other);
-  _args = other._args;
-  return *this;
-}*/
+const Module& AstFunc::module() const
+{
+  return _module;
+}
 
-AstFunc& AstFunc::operator=(AstFunc&& rhs) {
-  AstBase::operator=(std::move(rhs));
-  _args = std::move(rhs._args);
-  return *this;
+FuncId AstFunc::id() const
+{
+  return _id;
 }
 
-const FuncParams& AstFunc::args() const {
-  return _args;
+void AstFunc::setId(FuncId id)
+{
+  _id = id;
 }
 
-std::string_view AstFunc::fnName() const
+// static
+std::uint32_t AstFunc::bodyEpoch()
 {
-  return _tok.ident();
+  return Isolate::current()._bodyEpoch;
+}
+
+void AstFunc::recompile() const
+{
+  _code = compile(*this);
+  _codeEpoch = bodyEpoch();
+}
+
+void AstFunc::relink() const
+{
+  // some body has changed, but it matters only if it was inlined here
+  if (_code) {
+    const auto& inlined = _code->inlined();
+    auto unchanged = std::all_of(inlined.begin(), inlined.end(),
+      [](const auto& fn) {
+        return Isolate::current().funcById(fn.first).bodyVersion() == fn.second;
+      });
+    if (unchanged) {
+      _codeEpoch = bodyEpoch();
+      return;
+    }
+  }
+  recompile();
+}
+
+void AstFunc::freeze() const
+{
+  code();
+  _frozen = true;
+}
+
+void AstFunc::setBody(std::size_t tok)
+{
+  // the body changes now, even if it is parsed later
+  _code.reset();
+  _bodyVersion = ++Isolate::current()._bodyEpoch;
+  _children = {};
+  _bodyTok = static_cast<std::uint32_t>(tok);
+  _bodyParsed = false;
+}
+
+void AstFunc::parseBody() const
+{
+  // a syntax error leaves it unparsed, and is thrown again next time
+  AstChildren body;
+  if (!ModuleCache::loadBody(_module, _bodyTok, body))
+    body = atto::parseBody(_module, _bodyTok, _args);
+  auto self = const_cast<AstFunc*>(this);
+  self->_children = body;
+  _bodyParsed = true;
 }
 
 // -----------------------------------------------------------
 
 AstCall::AstCall(
   const Token& tok,
-  std::vector<AstBasePtr> params,
-  std::string fnName,
-  const Module& module
+  AstChildren params,
+  SymbolId fnName,
+  const Module& module,
+  FuncId funcId
 ) :
   AstBase{tok, LangType::Call, params},
   _fnName{fnName},
-  _module{module}
+  _module{module},
+  _funcId{funcId}
 { }
 
-/*AstCall::AstCall(const AstCall& other) :
-  AstBase{other}, _fnName{other._fnName}, _module{other._module}
-{}*/
-
-AstCall::AstCall(AstCall&& rhs) :
-  AstBase{std::move(rhs)},
-  _fnName{std::move(rhs._fnName)},
-  _module{std::move(rhs._module)}
-{}
-
-/*AstCall& AstCall::operator=(const AstCall& other) {
-  AstBase::operator=(other);
-  _fnName = other._fnName;
-  return *this;
-}*/
-
-AstCall& AstCall::operator=(AstCall&& rhs) {
-  AstBase::operator=(std::move(rhs));
-  _fnName = std::move(rhs._fnName);
-  return *this;
-}
-
-const std::vector<AstBasePtr>& AstCall::params() const
+const AstChildren& AstCall::params() const
 {
   return _children;
 }
 
 std::string_view AstCall::fnName() const
 {
-  return _fnName;
+  return Symbols::name(_fnName);
 }
 
 const Module& AstCall::module() const
@@ -218,12 +224,7 @@ const Module& AstCall::module() const
   return _module;
 }
 
-// static
-AstCall AstCall::mkFailed()
-{
-  std::vector<AstBasePtr> params;
-  auto tok = Token::mkFailure();
-  AstCall fcall{tok, std::move(params), "bad", *curModule()};
-  fcall._type = LangType::__Failure;
-  return fcall;
-}
\ No newline at end of file
+FuncId AstCall::funcId() const
+{
+  return _funcId;
+}
@@ -1,12 +1,16 @@
 #ifndef ATTO_AST_H
 #define ATTO_AST_H
 
-#include <vector>
-#include <unordered_map>
+#include <cstddef>
+#include <iterator>
 #include <memory>
+#include <new>
+#include <unordered_map>
+#include <vector>
 #include "common.hpp"
 #include "lex.hpp"
 #include "values.hpp"
+#include "bytecode.hpp"
 
 
 namespace atto {
@@ -14,50 +18,138 @@ namespace atto {
 class AstFunc;
 class AstBase;
 class AstCall;
+class AstArena;
 
 //! All functions in module should have this type
-using AstBasePtr = std::unique_ptr<const AstBase>;
 using AstFuncPtr = std::unique_ptr<const AstFunc>;
-using AstCallPtr = std::unique_ptr<const AstCall>;
 
-using FuncParams = std::vector<std::string>;
+/// Index of a function in the function table, see Isolate::funcById
+using FuncId = std::uint32_t;
+/// Index of a node in its AstArena
+using NodeId = std::uint32_t;
+
+using FuncParams = std::vector<SymbolId>;
 using FuncDef = std::pair<AstFuncPtr, FuncParams>;
-using FuncMap = std::unordered_map<std::string, FuncDef>;
+using FuncMap = std::unordered_map<SymbolId, FuncDef>;
+
+/**
+ * @brief The children of a node, NodeIds stored after each other
+ * in the arena. Iterates as const AstBase*
+ */
+class AstChildren {
+  const AstArena* _arena;
+  const NodeId* _ids;
+  std::uint32_t _size;
+public:
+  class iterator {
+    const AstArena* _arena;
+    const NodeId* _id;
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = const AstBase*;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const AstBase* const*;
+    using reference = const AstBase*;
+    iterator() : _arena{nullptr}, _id{nullptr} {}
+    iterator(const AstArena* arena, const NodeId* id) :
+      _arena{arena}, _id{id}
+    {}
+    inline const AstBase* operator*() const;
+    iterator& operator++() { ++_id; return *this; }
+    iterator operator++(int) { auto it = *this; ++_id; return it; }
+    bool operator==(const iterator& other) const { return _id == other._id; }
+    bool operator!=(const iterator& other) const { return _id != other._id; }
+  };
+
+  AstChildren() : _arena{nullptr}, _ids{nullptr}, _size{0} {}
+  AstChildren(const AstArena* arena, const NodeId* ids, std::uint32_t size) :
+    _arena{arena}, _ids{ids}, _size{size}
+  {}
+  std::size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+  inline const AstBase* operator[](std::size_t idx) const;
+  const AstBase* back() const { return (*this)[_size - 1]; }
+  iterator begin() const { return {_arena, _ids}; }
+  iterator end() const { return {_arena, _ids + _size}; }
+};
+
+/**
+ * @brief Owns the AST nodes of a module, each is allocated in large
+ * blocks and known by its NodeId. All of it is freed with the arena.
+ */
+class AstArena {
+  static constexpr std::size_t BlockSize = 64 * 1024;
+  std::vector<std::unique_ptr<char[]>> _blocks;
+  std::size_t _blockUsed, _blockBytes;
+  std::vector<AstBase*> _nodes;
+
+  void* alloc(std::size_t size, std::size_t align);
+public:
+  AstArena();
+  AstArena(const AstArena& other) = delete;
+  ~AstArena();
+  AstArena& operator=(const AstArena& other) = delete;
+
+  /// @brief Construct a T in this arena
+  template<typename T, typename... Args>
+  const T* make(Args&&... args);
+  /// @brief Store the ids of count children after each other
+  /// @return The range of them
+  AstChildren link(const AstBase* const* children, std::size_t count);
+  const AstBase* node(NodeId id) const { return _nodes[id]; }
+  /// @return How many nodes there are
+  std::size_t size() const { return _nodes.size(); }
+  /// @return Bytes used by nodes and links
+  std::size_t memoryUsage() const;
+};
 
 class AstBase
 {
+  friend class AstArena;
 protected:
-  const Token&  _tok;
+  Token _tok;
   LangType _type;
-  std::vector<AstBasePtr> _children;
+  NodeId _nodeId;
+  AstChildren _children;
 public:
-  AstBase(const Token& tok, LangType type);
-  AstBase(const Token& tok,
-       LangType type,
-       std::vector<AstBasePtr>& children);
+  AstBase(const Token& tok, LangType type, AstChildren children = {});
   AstBase(const AstBase& other) = delete;
-  AstBase(AstBase&& rhs);
+  virtual ~AstBase();
   AstBase& operator=(const AstBase& other) = delete;
-  AstBase& operator=(AstBase&& rhs);
   const Token& token() const;
   LangType type() const;
+  /// @brief Where this node is in its arena
+  NodeId nodeId() const { return _nodeId; }
   bool isFailed() const { return _type == LangType::__Failure; }
   const AstBase& operator[](std::size_t idx) const;
-  const std::vector<AstBasePtr>& children() const;
-  void addChildren(std::vector<AstBasePtr> children);
-
-  static AstBase mkFailed();
+  const AstChildren& children() const { return _children; }
 };
 
+template<typename T, typename... Args>
+const T* AstArena::make(Args&&... args)
+{
+  auto node = new (alloc(sizeof(T), alignof(T)))
+    T(std::forward<Args>(args)...);
+  node->_nodeId = static_cast<NodeId>(_nodes.size());
+  _nodes.emplace_back(node);
+  return node;
+}
+
+const AstBase* AstChildren::iterator::operator*() const
+{
+  return _arena->node(*_id);
+}
+
+const AstBase* AstChildren::operator[](std::size_t idx) const
+{
+  return _arena->node(_ids[idx]);
+}
+
 class AstValue : public AstBase
 {
   const Value _vlu;
 public:
   AstValue(const Token& tok, const Value value);
-  AstValue(const AstValue& other) = delete;
-  AstValue(AstValue&& rhs);
-  AstValue& operator=(AstValue&& rhs);
-  AstValue& operator=(const AstValue& other) = delete;
   const Value& value() const;
 };
 
@@ -66,45 +158,89 @@ class AstIdent : public AstBase
   std::size_t _localIdx;
 public:
   AstIdent(const Token& tok, std::size_t localIdx);
-  AstIdent(const AstIdent& other) = delete;
-  AstIdent(AstIdent&& rhs);
-  AstIdent& operator=(const AstIdent& other);
-  AstIdent& operator=(AstIdent&& rhs);
   std::size_t localIdx() const;
 };
 
+/**
+ * @brief A function definition, owned by the FuncMap of its module.
+ * The expressions of its body are in the arena of the module.
+ */
 class AstFunc : public AstBase
 {
   FuncParams _args;
+  const Module& _module;
+  FuncId _id;
+  mutable std::unique_ptr<const Chunk> _code;
+  mutable std::uint32_t _codeEpoch;
+  /// first token of the body
+  std::uint32_t _bodyTok;
+  /// the Isolate::_bodyEpoch when the body was set, tells bodies apart
+  std::uint32_t _bodyVersion;
+  /// false until the body is parsed
+  mutable bool _bodyParsed;
+  /// compiled for good, see freeze
+  mutable bool _frozen;
 public:
   AstFunc(const Token& tok,
-       FuncParams args);
-  AstFunc(const AstFunc& other) = delete;
-  AstFunc(AstFunc&& rhs);
-  AstFunc& operator=(const AstFunc& other);
-  AstFunc& operator=(AstFunc&& rhs);
+       FuncParams args,
+       const Module& module);
   const FuncParams& args() const;
   std::string_view fnName() const;
+  /// @brief The module this function is defined in
+  const Module& module() const;
+  /// @brief The slot of this function in the function table
+  FuncId id() const;
+  /// @brief Set by Module::addFunc when this function is defined
+  void setId(FuncId id);
+  /// @brief The bytecode for this function, compiled on first use
+  /// and again after a body it has inlined has changed
+  const Chunk& code() const {
+    if (!_code ||
+        (!_frozen && _codeEpoch != bodyEpoch()))
+      relink();
+    return *_code;
+  }
+  void recompile() const;
+  /// @brief Parse and compile now and never again, after this it is
+  /// only read so any number of threads may run it. Its body must not
+  /// be set again
+  void freeze() const;
+  /// @brief The body begins at token tok, parse it when first needed
+  void setBody(std::size_t tok);
+  /// @brief The first token of the body
+  std::size_t bodyTok() const { return _bodyTok; }
+  /// @brief Changes each time a body is set, to any function in the
+  /// isolate
+  std::uint32_t bodyVersion() const { return _bodyVersion; }
+  /// @brief The expressions of the body, parsed on first use
+  const AstChildren& body() const {
+    if (!_bodyParsed)
+      parseBody();
+    return _children;
+  }
+private:
+  /// the Isolate::_bodyEpoch of the isolate in use
+  static std::uint32_t bodyEpoch();
+  void parseBody() const;
+  void relink() const;
 };
 
 class AstCall : public AstBase
 {
-  std::string _fnName;
+  SymbolId _fnName;
   const Module& _module;
+  FuncId _funcId;
 public:
   AstCall(const Token& tok,
-       std::vector<AstBasePtr> params,
-       std::string fnName,
-       const Module& module);
-  AstCall(const AstCall& other) = delete;
-  AstCall(AstCall&& rhs);
-  AstCall& operator=(const AstCall& other);
-  AstCall& operator=(AstCall&& rhs);
-  const std::vector<AstBasePtr>& params() const;
+       AstChildren params,
+       SymbolId fnName,
+       const Module& module,
+       FuncId funcId = 0);
+  const AstChildren& params() const;
   std::string_view fnName() const;
   const Module& module() const;
-
-  static AstCall mkFailed();
+  /// @brief The called function, resolved when parsed
+  FuncId funcId() const;
 };
 
 } // end namspace atto
@@ -1,7 +1,10 @@
+#include <algorithm>
 #include <vector>
 #include <utility>
 #include <fstream>
+#include <sstream>
 #include "atto.hpp"
+#include "core_image.hpp"
 #include "lex.hpp"
 #include "parser.hpp"
 #include "values.hpp"
@@ -12,33 +15,38 @@
 
 using namespace atto;
 
-// private to this file
-namespace fs = std::filesystem;
 
 
-const Value eval(const std::function<const Value()> cb) {
+const std::optional<Value> eval(const std::function<const Value()> cb) {
   try {
     return cb();
 
   } catch (SyntaxError &e) {
     auto lines = split(std::string(e.module().code()), "\n");
-    std::cerr << e.typeName() << ": in " << e.module().path() << "\n"
-          << e.what() << " at line " << e.line() << " col " << e.col() << '\n'
-          << lines[e.line()-1] << '\n' << std::setw(e.col()+1) << '^' << "\n";
+    // in one write, other isolates may report errors too
+    std::ostringstream ss;
+    ss << e.typeName() << ": in " << e.module().path() << "\n"
+       << e.what() << " at line " << e.line() << " col " << e.col() << '\n'
+       << lines[e.line()-1] << '\n' << std::setw(e.col()+1) << '^' << "\n";
+    std::cerr << ss.str();
   } catch (Error &e) {
     std::cerr << e.typeName() << ": " << e.what() << "\n";
   }
-  return false;
+  return std::nullopt;
 }
 
 // -------------------------------------
 
-Atto::Atto(std::filesystem::path replHistoryPath) :
-  _replHistoryPath{replHistoryPath}, vm{}
+Atto::Atto(std::filesystem::path replHistoryPath, Vm::Engine engine,
+           std::filesystem::path corePath, ParseMode parseMode) :
+  _replHistoryPath{replHistoryPath}, _isolate{}, vm{engine}
 {
-  auto corePath = fs::path(__FILE__).parent_path().parent_path();
-  corePath.append("atto/core.at");
-  Module::module(std::string("__core__"), corePath);
+  Isolate::Use use(_isolate);
+  _isolate.setParseMode(parseMode);
+  if (corePath.empty())
+    _isolate.builtin("__core__", "core.at", coreSource(), coreImage());
+  else
+    _isolate.module("__core__", corePath);
 }
 
 Atto::~Atto()
@@ -46,15 +54,14 @@ Atto::~Atto()
   linenoise::linenoiseAtExit();
 }
 
-const Value Atto::execFile(
+const std::optional<Value> Atto::execFile(
   std::filesystem::path path, std::string modName)
 {
+  Isolate::Use use(_isolate);
   auto lambdaEval = [&]() -> const Value {
-    auto& mod = Module::module(modName, path);
-    if (mod.hasFunc("main")) {
-      const std::vector<std::shared_ptr<const Value>> args;
-      return *vm.eval(mod.func("main"), mod.funcs(), args);
-    }
+    auto& mod = _isolate.module(modName, path);
+    if (mod.hasFunc("main"))
+      return vm.call(mod.func("main"));
     return Value(false);
   };
 
@@ -65,28 +72,25 @@ const Value Atto::execFile(
 
 void Atto::repl()
 {
+  Isolate::Use use(_isolate);
   std::cout << "Welcome to the Atto prompt.\n"
         << "The core library is included by default.\n";
 
   linenoise::SetMultiLine(true);
   linenoise::LoadHistory(_replHistoryPath.c_str());
 
-  linenoise::SetCompletionCallback([](
+  linenoise::SetCompletionCallback([this](
     std::string editBuffer, std::vector<std::string>& completions)
   {    auto pos = editBuffer.find_last_of(" ");
     const auto str = editBuffer.substr(pos != std::string::npos ? pos+1 : 0);
     if (editBuffer == "f") completions.emplace_back("fn main is ");
     if (str == "i") completions.emplace_back(editBuffer + "s");
-    for (const auto& name : Module::allModuleNames()) {
-      for (const auto& fn : Module::module(name).funcs()) {
-        if (fn.first.substr(0, str.length()) == str)
-          completions.emplace_back(
-            editBuffer + fn.first.substr(str.length()));
-      }
-    }
+    for (auto fnName : _isolate.funcNames(str))
+      completions.emplace_back(
+        editBuffer + std::string(fnName.substr(str.length())));
   });
 
-  auto& main = Module::module("__main__","");
+  auto& main = _isolate.module("__main__","");
 
   std::string line;
   bool quit = false;
@@ -94,11 +98,11 @@ void Atto::repl()
     linenoise::AddHistory(line.c_str());
     if (line == "quit()") break;
     auto lambdaEval = [&]() -> const Value {
-      main.appendCode(line);
-      if (main.hasFunc("main")) {
-        const std::vector<std::shared_ptr<const Value>> args;
-        return *vm.eval(main.func("main"), main.funcs(), args);
-      }
+      // main runs again when it, or something it calls, is redefined
+      auto touched = main.appendCode(line);
+      if (std::find(touched.begin(), touched.end(),
+                    Symbols::find("main")) != touched.end())
+        return vm.call(main.func("main"));
       return Value(false);
     };
 
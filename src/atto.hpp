@@ -8,7 +8,9 @@
 #include <filesystem>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include "common.hpp"
+#include "isolate.hpp"
 #include "modules.hpp"
 #include "values.hpp"
 #include "vm.hpp"
@@ -23,12 +25,29 @@ class Atto
 {
 protected:
   std::filesystem::path _replHistoryPath;
+  /// the modules of this interpreter, used on the thread calling it
+  Isolate _isolate;
   Vm vm;
 public:
-  Atto(std::filesystem::path replHistoryPath = ".replHistory");
+  /**
+   * @brief Construct a new Atto object
+   *
+   * @param replHistoryPath Where repl saves its history
+   * @param engine What engine to run functions with
+   * @param corePath Load core from this file instead of the core
+   *  built into the executable
+   * @param parseMode When function bodies are parsed
+   */
+  Atto(std::filesystem::path replHistoryPath = ".replHistory",
+       Vm::Engine engine = Vm::Engine::Bytecode,
+       std::filesystem::path corePath = "",
+       ParseMode parseMode = ParseMode::Eager);
   ~Atto();
 
-  const Value execFile(std::filesystem::path path, std::string modName = "__main__");
+  /// @brief Load the file at path and call its main, if it has one
+  /// @return What main evaluated to, nullopt if a error was thrown,
+  ///  it is printed to stderr
+  const std::optional<Value> execFile(std::filesystem::path path, std::string modName = "__main__");
   void repl();
 };
 
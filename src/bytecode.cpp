@@ -0,0 +1,98 @@
+#include <sstream>
+#include <iomanip>
+#include "bytecode.hpp"
+#include "isolate.hpp"
+#include "modules.hpp"
+
+using namespace atto;
+
+std::string_view atto::opName(OpCode op)
+{
+  switch (op) {
+  case OpCode::Const:     return "Const";
+  case OpCode::Arg:       return "Arg";
+  case OpCode::Pop:       return "Pop";
+  case OpCode::Jump:      return "Jump";
+  case OpCode::JumpIfNot: return "JumpIfNot";
+  case OpCode::Call:      return "Call";
+  case OpCode::TailCall:  return "TailCall";
+  case OpCode::Return:    return "Return";
+  case OpCode::Head:      return "Head";
+  case OpCode::Tail:      return "Tail";
+  case OpCode::Fuse:      return "Fuse";
+  case OpCode::Pair:      return "Pair";
+  case OpCode::Eq:        return "Eq";
+  case OpCode::Add:       return "Add";
+  case OpCode::Neg:       return "Neg";
+  case OpCode::Mul:       return "Mul";
+  case OpCode::Div:       return "Div";
+  case OpCode::Rem:       return "Rem";
+  case OpCode::Less:      return "Less";
+  case OpCode::LessEq:    return "LessEq";
+  case OpCode::Litr:      return "Litr";
+  case OpCode::Str:       return "Str";
+  case OpCode::Words:     return "Words";
+  case OpCode::Input:     return "Input";
+  case OpCode::Print:     return "Print";
+  case OpCode::Len:       return "Len";
+  case OpCode::Skip:      return "Skip";
+  case OpCode::Nth:       return "Nth";
+  case OpCode::In:        return "In";
+  case OpCode::Split:     return "Split";
+  case OpCode::Wrap:      return "Wrap";
+  }
+  return "_unhandled_OpCode";
+}
+
+// ---------------------------------------------------------
+
+Chunk::Chunk() :
+  _code{}, _consts{}, _maxStack{0}, _inlined{}
+{}
+
+std::size_t Chunk::emit(OpCode op, std::uint32_t arg)
+{
+  _code.emplace_back(static_cast<Instr>(op) | (arg << 8));
+  return _code.size() - 1;
+}
+
+void Chunk::patch(std::size_t pos, std::uint32_t arg)
+{
+  _code[pos] = (_code[pos] & 0xFF) | (arg << 8);
+}
+
+std::uint32_t Chunk::addConst(Value vlu)
+{
+  _consts.emplace_back(std::move(vlu));
+  return static_cast<std::uint32_t>(_consts.size() - 1);
+}
+
+void Chunk::addInlined(std::uint32_t fn, std::uint32_t bodyVersion)
+{
+  for (const auto& inlined : _inlined)
+    if (inlined.first == fn)
+      return;
+  _inlined.emplace_back(fn, bodyVersion);
+}
+
+std::string Chunk::disassemble() const
+{
+  std::stringstream ss;
+  for (std::size_t pc = 0; pc < _code.size(); ++pc) {
+    auto op = opOf(_code[pc]);
+    auto arg = argOf(_code[pc]);
+    ss << std::setw(4) << pc << "  " << opName(op);
+    switch (op) {
+    case OpCode::Const: ss << ' ' << arg << " (" << _consts[arg].asStr() << ')';
+      break;
+    case OpCode::Call: case OpCode::TailCall:
+      ss << ' ' << arg << " (" << Isolate::current().funcById(arg).fnName() << ')';
+      break;
+    case OpCode::Arg: case OpCode::Jump: case OpCode::JumpIfNot:
+      ss << ' ' << arg; break;
+    default: break;
+    }
+    ss << '\n';
+  }
+  return ss.str();
+}
@@ -0,0 +1,95 @@
+#ifndef ATTO_BYTECODE_H
+#define ATTO_BYTECODE_H
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <utility>
+#include "values.hpp"
+
+namespace atto {
+
+/// @brief All instructions understood by the bytecode vm
+enum class OpCode : std::uint8_t {
+  // stack and control flow
+  Const,     // push constant[arg]
+  Arg,       // push argument[arg] from current frame
+  Pop,       // discard top of stack
+  Jump,      // continue at instruction arg
+  JumpIfNot, // pop condition, continue at arg if it is false
+  Call,      // call function with FuncId arg
+  TailCall,  // as Call, but replaces the current frame
+  Return,    // return top of stack to caller
+
+  // builtins, operands are taken from the stack
+  Head, Tail, Fuse, Pair,
+  Eq, Add, Neg, Mul, Div, Rem,
+  Less, LessEq,
+  Litr, Str, Words,
+  Input, Print,
+  Len, Skip, Nth, In, Split,
+  Wrap       // a list with top of stack as its only item, from inlining
+};
+
+/// @brief A single encoded instruction, opcode in the low 8 bits
+/// and the operand in the upper 24 bits
+using Instr = std::uint32_t;
+
+/// @brief Get the name of op as a string_view, useful for debug print
+std::string_view opName(OpCode op);
+
+/**
+ * @brief A compiled function body, a linear instruction stream
+ * together with the constants it refers to
+ */
+class Chunk {
+  std::vector<Instr> _code;
+  std::vector<Value> _consts;
+  std::uint32_t _maxStack;
+  /// FuncId and body version of the functions compiled into this
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> _inlined;
+public:
+  Chunk();
+  Chunk(const Chunk& other) = delete;
+  Chunk& operator=(const Chunk& other) = delete;
+
+  /// @brief Append a instruction
+  /// @return The position of the new instruction
+  std::size_t emit(OpCode op, std::uint32_t arg = 0);
+  /// @brief Change the operand of instruction at pos, used for jumps
+  void patch(std::size_t pos, std::uint32_t arg);
+  /// @brief Add a constant to this chunk
+  /// @return The index to use as operand to OpCode::Const
+  std::uint32_t addConst(Value vlu);
+  /// @brief Set the most values this chunk ever has on the stack
+  /// above its arguments, computed by the compiler
+  void setMaxStack(std::uint32_t maxStack) { _maxStack = maxStack; }
+  /// @brief Record that the body of function fn is compiled into this
+  /// chunk, so this chunk is stale when that body is replaced
+  void addInlined(std::uint32_t fn, std::uint32_t bodyVersion);
+
+  /// @return The number of instructions in this chunk
+  std::size_t size() const { return _code.size(); }
+  const Instr* code() const { return _code.data(); }
+  const Value& constant(std::uint32_t idx) const { return _consts[idx]; }
+  const std::vector<Value>& constants() const { return _consts; }
+  std::uint32_t maxStack() const { return _maxStack; }
+  /// @brief FuncId and body version of the functions inlined here
+  const std::vector<std::pair<std::uint32_t, std::uint32_t>>&
+  inlined() const { return _inlined; }
+
+  /// @brief Human readable listing of this chunk
+  std::string disassemble() const;
+
+  static OpCode opOf(Instr ins) {
+    return static_cast<OpCode>(ins & 0xFF);
+  }
+  static std::uint32_t argOf(Instr ins) {
+    return ins >> 8;
+  }
+};
+
+} // namespace atto
+
+#endif // ATTO_BYTECODE_H
@@ -0,0 +1,561 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.hpp"
+#include "modules.hpp"
+#include "symbols.hpp"
+
+using namespace atto;
+namespace fs = std::filesystem;
+
+namespace {
+
+/// bump when the layout below or the tokens lex gives changes
+constexpr std::uint32_t FormatVersion = 2;
+/// smaller sources lex faster than a cache file is found and read
+constexpr std::size_t MinSourceSize = 4096;
+
+constexpr char Magic[8] = {'a', 't', 't', 'o', 'm', 'o', 'd', '\0'};
+
+/**
+ * A cache file is a Header followed by, each padded to 4 bytes:
+ *   path        char[pathSize], the absolute path of the source
+ *   nameEnds    uint32[symbolCount], name n ends at nameEnds[n]
+ *   names       char[namesSize]
+ *   symbols     uint32[tokenCount], index of the name of each token
+ *   offsets     uint32[tokenCount]
+ *   outline     CachedDef[defCount]
+ *   types       uint8[tokenCount]
+ *   bodies      CachedBody[bodyCount], by tok
+ *   nodes       CachedNode[nodeCount], the AST of the bodies
+ * Only the image built into atto has bodies, cache files have none.
+ */
+struct Header {
+  char magic[8];
+  std::uint32_t format;
+  std::uint32_t langTypes; // LangType::__Finished, a new type changes it
+  std::uint64_t sourceSize;
+  std::uint64_t sourceHash;
+  std::uint64_t dataHash; // of everything after the header
+  std::uint32_t pathSize;
+  std::uint32_t symbolCount;
+  std::uint32_t namesSize;
+  std::uint32_t tokenCount;
+  std::uint32_t defCount;
+  std::uint32_t bodyCount;
+  std::uint32_t nodeCount;
+  std::uint32_t funcBase; // FuncId of the first function in the module
+};
+
+struct CachedDef {
+  std::uint32_t type, tok, body;
+};
+
+/// the body beginning at token tok is nodes [firstNode, firstNode +
+/// nodeCount), the last exprCount of them left are its expressions
+struct CachedBody {
+  std::uint32_t tok, firstNode, nodeCount, exprCount;
+};
+
+/// a node after its children, arg is localIdx of an Ident and
+/// FuncId of a Call
+struct CachedNode {
+  std::uint32_t type, tok, arg, children;
+};
+
+constexpr auto LangTypes = static_cast<std::uint32_t>(LangType::__Finished);
+
+std::size_t padded(std::size_t size)
+{
+  return (size + 3) & ~std::size_t{3};
+}
+
+/// only needs to notice a changed file, so 8 bytes at a time
+std::uint64_t hashOf(std::string_view text)
+{
+  constexpr std::uint64_t mul = 0xFF51AFD7ED558CCDull;
+  std::uint64_t hash = 0x9E3779B97F4A7C15ull ^ text.size();
+  std::size_t pos = 0;
+  for (; pos + 8 <= text.size(); pos += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, text.data() + pos, 8);
+    hash = (hash ^ word) * mul;
+    hash ^= hash >> 32;
+  }
+  std::uint64_t tail = 0;
+  std::memcpy(&tail, text.data() + pos, text.size() - pos);
+  hash = (hash ^ tail) * mul;
+  return hash ^ (hash >> 29);
+}
+
+fs::path& cacheDir()
+{
+  static fs::path dir = []() -> fs::path {
+    if (auto env = std::getenv("ATTO_CACHE_DIR"))
+      return env;
+    if (auto env = std::getenv("XDG_CACHE_HOME"); env && *env)
+      return fs::path(env) / "atto";
+    if (auto env = std::getenv("HOME"); env && *env)
+      return fs::path(env) / ".cache" / "atto";
+    return {};
+  }();
+  return dir;
+}
+
+/// the source path as stored in cache, and the cache file for it
+std::pair<std::string, fs::path> cachePaths(const Module& module)
+{
+  auto source = fs::absolute(module.path()).lexically_normal().string();
+  char name[24];
+  std::snprintf(name, sizeof(name), "%016llx.atc",
+                static_cast<unsigned long long>(hashOf(source)));
+  return {source, cacheDir() / name};
+}
+
+bool useCache(const Module& module)
+{
+  return !cacheDir().empty() && !module.path().empty() &&
+    module.code().size() >= MinSourceSize;
+}
+
+/// map a cache file, empty if there is none
+Source mapFile(const fs::path& path)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return Source();
+  struct stat st{};
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      static_cast<std::size_t>(st.st_size) >= sizeof(Header))
+  {
+    map = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ,
+               MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED)
+    return Source();
+  return Source(static_cast<const char*>(map),
+                static_cast<std::size_t>(st.st_size));
+}
+
+/// reads the arrays following the header, fails instead of
+/// reading past the end
+class Reader {
+  std::string_view _data;
+  std::size_t _pos;
+  bool _ok;
+public:
+  Reader(std::string_view data) :
+    _data{data}, _pos{sizeof(Header)}, _ok{true}
+  {}
+
+  template<typename T>
+  const T* array(std::size_t count) {
+    auto size = sizeof(T) * count;
+    if (!_ok || padded(size) > _data.size() - _pos) {
+      _ok = false;
+      return nullptr;
+    }
+    // the mapping is page aligned and every array is padded to 4
+    auto items = reinterpret_cast<const T*>(_data.data() + _pos);
+    _pos += padded(size);
+    return items;
+  }
+  /// @return true if all was read without going past the end
+  bool atEnd() const { return _ok && _pos == _data.size(); }
+};
+
+/// the arrays following the header
+struct Arrays {
+  const char* path;
+  const std::uint32_t* nameEnds;
+  const char* names;
+  const std::uint32_t* symbols;
+  const std::uint32_t* offsets;
+  const CachedDef* defs;
+  const std::uint8_t* types;
+  const CachedBody* bodies;
+  const CachedNode* nodes;
+};
+
+/// @brief Find the arrays of head in data
+/// @return false if they do not fit in data
+bool readArrays(std::string_view data, const Header& head, Arrays& arrays)
+{
+  Reader reader(data);
+  arrays.path = reader.array<char>(head.pathSize);
+  arrays.nameEnds = reader.array<std::uint32_t>(head.symbolCount);
+  arrays.names = reader.array<char>(head.namesSize);
+  arrays.symbols = reader.array<std::uint32_t>(head.tokenCount);
+  arrays.offsets = reader.array<std::uint32_t>(head.tokenCount);
+  arrays.defs = reader.array<CachedDef>(head.defCount);
+  arrays.types = reader.array<std::uint8_t>(head.tokenCount);
+  arrays.bodies = reader.array<CachedBody>(head.bodyCount);
+  arrays.nodes = reader.array<CachedNode>(head.nodeCount);
+  return reader.atEnd();
+}
+
+void append(std::string& out, const void* data, std::size_t size)
+{
+  out.append(static_cast<const char*>(data), size);
+  out.append(padded(size) - size, '\0');
+}
+
+/// write to a temporary file first, so nobody maps a half written file
+void writeFile(const fs::path& path, const std::string& data)
+{
+  std::error_code err;
+  fs::create_directories(path.parent_path(), err);
+  // other threads, of this or another isolate, may write it too
+  static std::atomic<unsigned> writes{0};
+  auto tmpPath = path;
+  tmpPath += "." + std::to_string(getpid()) + "." +
+             std::to_string(writes++) + ".tmp";
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd < 0)
+    return;
+  std::size_t done = 0;
+  while (done < data.size()) {
+    auto n = write(fd, data.data() + done, data.size() - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += static_cast<std::size_t>(n);
+  }
+  if (close(fd) != 0 || done != data.size() ||
+      rename(tmpPath.c_str(), path.c_str()) != 0)
+  {
+    unlink(tmpPath.c_str());
+  }
+}
+
+/// @brief Find out if a cache file is for source with code and has
+/// nothing in it that reads out of bounds
+bool validImage(std::string_view data, const Header& head,
+                const Arrays& arrays, const std::string& source,
+                std::string_view code)
+{
+  if (std::string_view(arrays.path, head.pathSize) != source ||
+      head.sourceHash != hashOf(code) ||
+      head.dataHash != hashOf(data.substr(sizeof(Header))) ||
+      head.bodyCount != 0 || head.nodeCount != 0)
+  {
+    return false;
+  }
+
+  // the hash catches a damaged file, this keeps a made up one
+  // from reading out of bounds
+  auto nameEnds = arrays.nameEnds;
+  for (std::uint32_t i = 0, prev = 0; i < head.symbolCount; prev = nameEnds[i++])
+    if (nameEnds[i] < prev || nameEnds[i] > head.namesSize)
+      return false;
+  for (std::uint32_t i = 0; i < head.tokenCount; ++i)
+    if (arrays.symbols[i] >= head.symbolCount ||
+        arrays.offsets[i] >= code.size() || arrays.types[i] >= LangTypes)
+      return false;
+  auto typeAt = [&](std::uint32_t tok) {
+    return static_cast<LangType>(arrays.types[tok]);
+  };
+  for (std::uint32_t i = 0; i < head.defCount; ++i) {
+    auto def = arrays.defs[i];
+    if (def.type == static_cast<std::uint32_t>(LangType::Import)) {
+      if (def.tok >= head.tokenCount || typeAt(def.tok) != LangType::Str_litr)
+        return false;
+    } else if (def.type == static_cast<std::uint32_t>(LangType::Fn)) {
+      if (def.tok >= def.body || def.body > head.tokenCount ||
+          typeAt(def.body - 1) != LangType::Is)
+        return false;
+      for (auto tok = def.tok; tok + 1 < def.body; ++tok)
+        if (typeAt(tok) != LangType::Ident)
+          return false;
+    } else
+      return false;
+  }
+  return true;
+}
+
+/// @brief Add the tokens in image to module
+/// @param source The path image must be for, nullptr for the image
+///  built into atto. That is made from the same code by the build,
+///  so it is not hashed or checked
+bool loadImage(Module& module, std::string_view data,
+               const std::string* source, Outline& defs)
+{
+  if (data.size() < sizeof(Header))
+    return false;
+  Header head;
+  std::memcpy(&head, data.data(), sizeof(head));
+  auto code = module.code();
+  if (std::memcmp(head.magic, Magic, sizeof(Magic)) != 0 ||
+      head.format != FormatVersion || head.langTypes != LangTypes ||
+      head.sourceSize != code.size() ||
+      (source && head.pathSize != source->size()))
+  {
+    return false;
+  }
+
+  Arrays arrays;
+  if (!readArrays(data, head, arrays) ||
+      (source && !validImage(data, head, arrays, *source, code)))
+  {
+    return false;
+  }
+
+  std::vector<SymbolId> ids(head.symbolCount);
+  for (std::uint32_t i = 0, begin = 0; i < head.symbolCount;
+       begin = arrays.nameEnds[i++])
+  {
+    ids[i] = Symbols::intern(
+      {arrays.names + begin, arrays.nameEnds[i] - begin});
+  }
+  module.reserveTokens(head.tokenCount);
+  for (std::uint32_t i = 0; i < head.tokenCount; ++i)
+    module.addToken(static_cast<LangType>(arrays.types[i]),
+                    ids[arrays.symbols[i]], arrays.offsets[i]);
+  defs.clear();
+  defs.reserve(head.defCount);
+  for (std::uint32_t i = 0; i < head.defCount; ++i) {
+    auto def = arrays.defs[i];
+    defs.push_back({static_cast<LangType>(def.type), def.tok, def.body});
+  }
+  return true;
+}
+
+/// @brief Add expr to nodes, after its children
+/// @return false if it calls a function in another module, what FuncId
+///  that has depends on what was loaded before
+bool addNodes(const Module& module, const AstBase& expr,
+              std::vector<CachedNode>& nodes)
+{
+  for (auto child : expr.children())
+    if (!addNodes(module, *child, nodes))
+      return false;
+  std::uint32_t arg = 0;
+  if (expr.type() == LangType::Ident) {
+    arg = static_cast<std::uint32_t>(
+      static_cast<const AstIdent&>(expr).localIdx());
+  } else if (expr.type() == LangType::Call) {
+    const auto& call = static_cast<const AstCall&>(expr);
+    if (&call.module() != &module)
+      return false;
+    arg = call.funcId();
+  }
+  nodes.push_back({static_cast<std::uint32_t>(expr.type()),
+                   static_cast<std::uint32_t>(expr.token().index()), arg,
+                   static_cast<std::uint32_t>(expr.children().size())});
+  return true;
+}
+
+/// @brief The parsed bodies of the functions in defs
+/// @return false if they can't be stored
+bool addBodies(const Module& module, const Outline& defs,
+               std::vector<CachedBody>& bodies,
+               std::vector<CachedNode>& nodes, std::uint32_t& funcBase)
+{
+  const auto& toks = module.tokens();
+  funcBase = ~std::uint32_t{0};
+  for (const auto& [name, def] : module.funcs())
+    funcBase = std::min(funcBase, def.first->id());
+  for (const auto& def : defs) {
+    if (def.type != LangType::Fn)
+      continue;
+    const auto& fn = *module.funcs().at(toks.symbol(def.tok)).first;
+    // only the last of a function defined twice is used
+    if (fn.bodyTok() != def.body)
+      continue;
+    CachedBody body{def.body, static_cast<std::uint32_t>(nodes.size()), 0,
+                    static_cast<std::uint32_t>(fn.body().size())};
+    for (auto expr : fn.body())
+      if (!addNodes(module, *expr, nodes))
+        return false;
+    body.nodeCount = static_cast<std::uint32_t>(nodes.size()) - body.firstNode;
+    bodies.emplace_back(body);
+  }
+  return true;
+}
+
+/// @brief The tokens of module and defs as an image for source
+/// @param withBodies Add the parsed bodies of its functions too
+std::string makeImage(const Module& module, std::string_view source,
+                      const Outline& defs, bool withBodies)
+{
+  const auto& toks = module.tokens();
+  auto code = module.code();
+
+  // number the symbols in this module from 0
+  constexpr auto NoIndex = ~std::uint32_t{0};
+  std::vector<std::uint32_t> local(Symbols::size(), NoIndex);
+  std::vector<std::uint32_t> nameEnds, symbols(toks.size()), offsets(toks.size());
+  std::vector<std::uint8_t> types(toks.size());
+  std::string names;
+  for (std::size_t i = 0; i < toks.size(); ++i) {
+    auto& idx = local[toks.symbol(i)];
+    if (idx == NoIndex) {
+      idx = static_cast<std::uint32_t>(nameEnds.size());
+      names += Symbols::name(toks.symbol(i));
+      nameEnds.emplace_back(static_cast<std::uint32_t>(names.size()));
+    }
+    symbols[i] = idx;
+    offsets[i] = toks.offset(i);
+    types[i] = static_cast<std::uint8_t>(toks.type(i));
+  }
+  std::vector<CachedDef> cachedDefs;
+  cachedDefs.reserve(defs.size());
+  for (const auto& def : defs)
+    cachedDefs.push_back({static_cast<std::uint32_t>(def.type),
+                          def.tok, def.body});
+  std::vector<CachedBody> bodies;
+  std::vector<CachedNode> nodes;
+  std::uint32_t funcBase = 0;
+  if (withBodies && !addBodies(module, defs, bodies, nodes, funcBase)) {
+    // parsed again when loaded
+    bodies.clear();
+    nodes.clear();
+  }
+
+  Header head{};
+  std::memcpy(head.magic, Magic, sizeof(Magic));
+  head.format = FormatVersion;
+  head.langTypes = LangTypes;
+  head.sourceSize = code.size();
+  head.sourceHash = hashOf(code);
+  head.pathSize = static_cast<std::uint32_t>(source.size());
+  head.symbolCount = static_cast<std::uint32_t>(nameEnds.size());
+  head.namesSize = static_cast<std::uint32_t>(names.size());
+  head.tokenCount = static_cast<std::uint32_t>(toks.size());
+  head.defCount = static_cast<std::uint32_t>(cachedDefs.size());
+  head.bodyCount = static_cast<std::uint32_t>(bodies.size());
+  head.nodeCount = static_cast<std::uint32_t>(nodes.size());
+  head.funcBase = funcBase;
+
+  std::string out;
+  out.reserve(sizeof(head) + source.size() + names.size() +
+              toks.size() * 9 + nameEnds.size() * 4 + defs.size() * 12 +
+              (bodies.size() + nodes.size()) * 16 + 32);
+  append(out, &head, sizeof(head));
+  append(out, source.data(), source.size());
+  append(out, nameEnds.data(), nameEnds.size() * 4);
+  append(out, names.data(), names.size());
+  append(out, symbols.data(), symbols.size() * 4);
+  append(out, offsets.data(), offsets.size() * 4);
+  append(out, cachedDefs.data(), cachedDefs.size() * sizeof(CachedDef));
+  append(out, types.data(), types.size());
+  append(out, bodies.data(), bodies.size() * sizeof(CachedBody));
+  append(out, nodes.data(), nodes.size() * sizeof(CachedNode));
+  head.dataHash = hashOf(std::string_view(out).substr(sizeof(Header)));
+  std::memcpy(out.data(), &head, sizeof(head));
+  return out;
+}
+
+} // namespace
+
+// static
+const fs::path& ModuleCache::directory()
+{
+  return cacheDir();
+}
+
+// static
+void ModuleCache::setDirectory(fs::path dir)
+{
+  cacheDir() = std::move(dir);
+}
+
+// static
+bool ModuleCache::load(Module& module, Outline& defs)
+{
+  if (!useCache(module) || module.tokens().size() > 0)
+    return false;
+  auto [source, cachePath] = cachePaths(module);
+  auto file = mapFile(cachePath);
+  return loadImage(module, file.view(), &source, defs);
+}
+
+// static
+void ModuleCache::store(const Module& module, const Outline& defs)
+{
+  if (!useCache(module))
+    return;
+  auto [source, cachePath] = cachePaths(module);
+  writeFile(cachePath, makeImage(module, source, defs, false));
+}
+
+// static
+bool ModuleCache::load(Module& module, std::string_view image, Outline& defs)
+{
+  if (module.tokens().size() > 0)
+    return false;
+  return loadImage(module, image, nullptr, defs);
+}
+
+// static
+std::string ModuleCache::image(const Module& module, const Outline& defs)
+{
+  return makeImage(module, module.path().string(), defs, true);
+}
+
+// static
+std::uint32_t ModuleCache::funcBase(std::string_view image)
+{
+  Header head;
+  std::memcpy(&head, image.data(), sizeof(head));
+  return head.funcBase;
+}
+
+// static
+bool ModuleCache::loadBody(const Module& module, std::size_t body,
+                           AstChildren& exprs)
+{
+  auto image = module.image();
+  if (image.empty())
+    return false;
+  Header head;
+  std::memcpy(&head, image.data(), sizeof(head));
+  Arrays arrays;
+  readArrays(image, head, arrays);
+  auto end = arrays.bodies + head.bodyCount;
+  auto found = std::lower_bound(arrays.bodies, end, body,
+    [](const CachedBody& b, std::size_t tok) { return b.tok < tok; });
+  if (found == end || found->tok != body)
+    return false;
+
+  // each node is made after its children, which are the last on stack
+  auto& arena = module.arena();
+  std::vector<const AstBase*> stack;
+  auto node = arrays.nodes + found->firstNode;
+  for (auto last = node + found->nodeCount; node != last; ++node) {
+    auto tok = module.token(node->tok);
+    auto type = static_cast<LangType>(node->type);
+    auto children = arena.link(stack.data() + stack.size() - node->children,
+                               node->children);
+    stack.resize(stack.size() - node->children);
+    switch (type) {
+    case LangType::Value:
+      stack.emplace_back(arena.make<AstValue>(tok, Value(tok)));
+      break;
+    case LangType::Ident:
+      stack.emplace_back(arena.make<AstIdent>(tok, node->arg));
+      break;
+    case LangType::Call:
+      stack.emplace_back(arena.make<AstCall>(
+        tok, children, tok.symbol(), module, node->arg));
+      break;
+    default:
+      stack.emplace_back(arena.make<AstBase>(tok, type, children));
+    }
+  }
+  exprs = arena.link(stack.data(), stack.size());
+  return true;
+}
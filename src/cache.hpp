@@ -0,0 +1,60 @@
+#ifndef ATTO_CACHE_H
+#define ATTO_CACHE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include "parser.hpp"
+
+namespace atto {
+
+class Module;
+
+/**
+ * @brief Lexed modules on disk, so a module that has not changed
+ * since last run is not lexed and outlined again.
+ *
+ * A cache file holds the tokens, their symbols and the outline of
+ * one source file. It is used only when the path, size and hash of
+ * the source and the cache format all match.
+ * The directory is $ATTO_CACHE_DIR, else $XDG_CACHE_HOME/atto or
+ * ~/.cache/atto. Set ATTO_CACHE_DIR to empty to turn it off.
+ */
+class ModuleCache {
+public:
+  /// @brief Where cache files are stored, empty when turned off
+  static const std::filesystem::path& directory();
+  /// @brief Store cache files in dir instead, empty turns cache off
+  static void setDirectory(std::filesystem::path dir);
+  /// @brief Load the tokens and outline for module from cache
+  /// @param module A module with code but no tokens
+  /// @param defs Gets the outline of module
+  /// @return true if loaded, false if there is no valid cache
+  static bool load(Module& module, Outline& defs);
+  /// @brief Write the tokens and outline of module to cache,
+  /// failures are ignored
+  static void store(const Module& module, const Outline& defs);
+  /// @brief The tokens, outline and parsed function bodies of module
+  /// in the cache file format, used to build a module into the executable
+  /// @param module Loaded into the isolate in use
+  static std::string image(const Module& module, const Outline& defs);
+  /// @brief Load the tokens and outline for module from image, which
+  /// is trusted and not hashed or checked
+  /// @param image Made by image() from the same code as module has
+  /// @return true if loaded, false if image does not fit module
+  static bool load(Module& module, std::string_view image, Outline& defs);
+  /// @brief The FuncId the first function of the module in image had,
+  /// the calls in its bodies are to FuncIds counted from that
+  static std::uint32_t funcBase(std::string_view image);
+  /// @brief Make the body beginning at token body from the image module
+  /// was loaded from, instead of parsing it
+  /// @param exprs Gets the expressions of the body
+  /// @return false if module has no image or it has no such body
+  static bool loadBody(const Module& module, std::size_t body,
+                       AstChildren& exprs);
+};
+
+} // namespace atto
+
+#endif // ATTO_CACHE_H
@@ -2,12 +2,15 @@
 #include "errors.hpp"
 #include <sstream>
 #include <iostream>
-#include <fstream>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 namespace atto {
 
-namespace fs = std::filesystem;
 
 std::string_view typeName(LangType type)
 {
@@ -20,6 +23,7 @@ std::string_view typeName(LangType type)
   case LangType::Head:   return "Head";
   case LangType::Neg:    return "Neg";
   case LangType::Import: return "Import";
+  case LangType::Len:    return "Len";
   case LangType::Tail:   return "Tail";
   case LangType::Fuse:   return "Fuse";
   case LangType::Pair:   return "Pair";
@@ -29,6 +33,10 @@ std::string_view typeName(LangType type)
   case LangType::Div:    return "Div";
   case LangType::Rem:    return "Rem";
   case LangType::Less:   return "Less";
+  case LangType::Skip:   return "Skip";
+  case LangType::Nth:    return "Nth";
+  case LangType::In:     return "In";
+  case LangType::Split:  return "Split";
   case LangType::LessEq: return "LessEq";
   case LangType::If:     return "If";
   case LangType::Value:  return "Value";
@@ -141,44 +149,128 @@ std::vector<std::string> utf8_words(const std::string& str)
   return words;
 }
 
-std::string readFile(std::filesystem::path path, bool& success)
+std::size_t utf8_len(std::string_view str)
 {
-  success = false;
-  auto filestat = fs::status(path);
-  if (!fs::exists(path)) {
-    std::cerr << "File: " << path << " does not exist.\n";
-    return "";
+  std::size_t len = 0;
+  for (auto c : str)
+    // continuation bytes are 10xxxxxx
+    if ((c & 0xC0) != 0x80)
+      ++len;
+  return len;
+}
+
+std::size_t utf8_offset(std::string_view str, std::size_t idx)
+{
+  std::size_t pos = 0;
+  for (; pos < str.size(); ++pos) {
+    if ((str[pos] & 0xC0) != 0x80 && idx-- == 0)
+      break;
   }
-  if (!fs::is_regular_file(filestat)) {
-    std::cerr << "File: " << path << " is not a regular file.\n";
-    return "";
+  return pos;
+}
+
+Source::Source() :
+  _text{}, _map{nullptr}, _mapSize{0}
+{}
+
+Source::Source(std::string text) :
+  _text{std::move(text)}, _map{nullptr}, _mapSize{0}
+{}
+
+Source::Source(const char* map, std::size_t size) :
+  _text{}, _map{map}, _mapSize{size}
+{}
+
+Source::Source(Source&& rhs) :
+  _text{std::move(rhs._text)}, _map{rhs._map}, _mapSize{rhs._mapSize}
+{
+  rhs._map = nullptr;
+  rhs._mapSize = 0;
+}
+
+Source::~Source()
+{
+  if (_map)
+    munmap(const_cast<char*>(_map), _mapSize);
+}
+
+Source& Source::operator=(Source&& rhs)
+{
+  if (this != &rhs) {
+    if (_map)
+      munmap(const_cast<char*>(_map), _mapSize);
+    _text = std::move(rhs._text);
+    _map = rhs._map;
+    _mapSize = rhs._mapSize;
+    rhs._map = nullptr;
+    rhs._mapSize = 0;
   }
+  return *this;
+}
 
-  auto perms = filestat.permissions();
-  if ((perms & fs::perms::owner_read) == fs::perms::none ||
-      (perms & fs::perms::group_read) == fs::perms::none ||
-      (perms & fs::perms::others_read) == fs::perms::none)
-  {
-    std::cerr << "Insufficient privileges to access file: " << path << ".\n";
-    return "";
+void Source::append(std::string_view text)
+{
+  if (_map) {
+    _text.assign(_map, _mapSize);
+    munmap(const_cast<char*>(_map), _mapSize);
+    _map = nullptr;
+    _mapSize = 0;
+  }
+  _text += text;
+}
+
+Source readFile(std::filesystem::path path, bool& success)
+{
+  success = false;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT)
+      std::cerr << "File: " << path << " does not exist.\n";
+    else if (errno == EACCES)
+      std::cerr << "Insufficient privileges to access file: " << path << ".\n";
+    else
+      std::cerr << "Failed to open file " << path << '\n';
+    return Source();
   }
 
-  if (fs::is_empty(path)) {
+  struct stat st{};
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    std::cerr << "File: " << path << " is not a regular file.\n";
+    close(fd);
+    return Source();
+  }
+  if (st.st_size == 0) {
     std::cerr << "File: " << path << " is empty.";
-    return "";
+    close(fd);
+    return Source();
   }
 
-  std::ifstream file;
-  file.open(path, std::ios::in);
-  if (file.is_open()) {
-    std::stringstream ss;
-    ss << file.rdbuf();
-    file.close();
+  auto size = static_cast<std::size_t>(st.st_size);
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map != MAP_FAILED) {
+    close(fd);
     success = true;
-    return ss.str();
+    return Source(static_cast<const char*>(map), size);
+  }
+
+  // could not be mapped, read it
+  std::string text(size, '\0');
+  std::size_t done = 0;
+  while (done < size) {
+    auto n = read(fd, text.data() + done, size - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += static_cast<std::size_t>(n);
+  }
+  close(fd);
+  if (done != size) {
+    std::cerr << "Failed to read file " << path << '\n';
+    return Source();
   }
-  std::cerr << "Failed to open file " << path << '\n';
-  return "";
+  success = true;
+  return Source(std::move(text));
 }
 
 } // namespace atto
@@ -42,6 +42,13 @@ std::string utf8_substr(const std::string& str,
 /// @param str The source text to get the words from
 /// @return Vector with all words
 std::vector<std::string> utf8_words(const std::string& str);
+/// @brief Count the utf8 letters in str
+std::size_t utf8_len(std::string_view str);
+/// @brief Find where a utf8 letter begins
+/// @param str The string to search
+/// @param idx The letter to find
+/// @return The byte offset of letter idx, str.size() if past end
+std::size_t utf8_offset(std::string_view str, std::size_t idx);
 
 // ---------------------------------------------------------
 
@@ -52,7 +59,7 @@ enum class LangType {
   List, // first in 1
   Litr, Str, Words,
   Input, Print, Head, Neg,
-  Import,
+  Import, Len,
   Tail, // last in 1
 
 
@@ -60,6 +67,7 @@ enum class LangType {
   Fuse, // first in 2
   Pair, Eq, Add,
   Mul, Div, Rem, Less,
+  Skip, Nth, In, Split,
   LessEq, // last in 2
 
   // special case these
@@ -93,11 +101,40 @@ enum class LexTypes {
 /// @return The typename as a string_view
 std::string_view typeName(LangType type);
 
-/// @brief Read (text)file at path
+/**
+ * @brief Source code text, either a read only mapping of a file
+ * or a string in memory
+ */
+class Source {
+  std::string _text;
+  const char* _map;
+  std::size_t _mapSize;
+public:
+  Source();
+  explicit Source(std::string text);
+  /// @brief Take ownership of a mapping made by mmap
+  Source(const char* map, std::size_t size);
+  Source(const Source& other) = delete;
+  Source(Source&& rhs);
+  ~Source();
+  Source& operator=(const Source& other) = delete;
+  Source& operator=(Source&& rhs);
+
+  /// @brief All of the text
+  std::string_view view() const {
+    return _map ? std::string_view(_map, _mapSize) : _text;
+  }
+  /// @brief Append text, a mapped file is copied to memory first
+  void append(std::string_view text);
+  /// @return true if this is a mapped file
+  bool isMapped() const { return _map != nullptr; }
+};
+
+/// @brief Read (text)file at path, mapped if possible else read
 /// @param path the path to the file to read
 /// @param success get set to true if read was successful
-/// @return All read bytes in this file
-std::string readFile(std::filesystem::path path, bool& success);
+/// @return All bytes in this file
+Source readFile(std::filesystem::path path, bool& success);
 
 } // namespace atto
 
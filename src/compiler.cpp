@@ -0,0 +1,450 @@
+#include <iostream>
+#include <algorithm>
+#include <optional>
+#include "compiler.hpp"
+#include "errors.hpp"
+#include "isolate.hpp"
+#include "modules.hpp"
+
+//#define DEBUG(x) do { std::cerr << x; } while (0)
+#define DEBUG(x)
+
+namespace atto {
+
+namespace {
+
+/// @brief The opcode for a builtin such as __add, if type is one
+std::optional<OpCode> builtinOp(LangType type)
+{
+  switch (type) {
+  case LangType::Eq:     return OpCode::Eq;
+  case LangType::Add:    return OpCode::Add;
+  case LangType::Neg:    return OpCode::Neg;
+  case LangType::Mul:    return OpCode::Mul;
+  case LangType::Div:    return OpCode::Div;
+  case LangType::Rem:    return OpCode::Rem;
+  case LangType::Less:   return OpCode::Less;
+  case LangType::LessEq: return OpCode::LessEq;
+  case LangType::Head:   return OpCode::Head;
+  case LangType::Tail:   return OpCode::Tail;
+  case LangType::Fuse:   return OpCode::Fuse;
+  case LangType::Pair:   return OpCode::Pair;
+  case LangType::Words:  return OpCode::Words;
+  case LangType::Litr:   return OpCode::Litr;
+  case LangType::Str:    return OpCode::Str;
+  case LangType::Input:  return OpCode::Input;
+  case LangType::Print:  return OpCode::Print;
+  case LangType::Len:    return OpCode::Len;
+  case LangType::Skip:   return OpCode::Skip;
+  case LangType::Nth:    return OpCode::Nth;
+  case LangType::In:     return OpCode::In;
+  case LangType::Split:  return OpCode::Split;
+  default: return std::nullopt;
+  }
+}
+
+/// @brief False for builtins with side effects
+bool isPure(OpCode op)
+{
+  return op != OpCode::Input && op != OpCode::Print;
+}
+
+// -----------------------------------------------------------------
+// inlining
+
+/**
+ * @brief What a function computes in terms of its parameters.
+ * Only pure function bodies, without calls that can't be inlined
+ * and without if, gets a Term. As a Term has no side effects
+ * it can be evaluated in any order, or not at all.
+ */
+struct Term {
+  enum class Kind { Param, Const, Op };
+  Kind kind;
+  OpCode op;
+  std::uint32_t param;
+  Value vlu;
+  std::vector<Term> kids;
+
+  static Term mkParam(std::uint32_t idx) {
+    return Term{Kind::Param, OpCode::Const, idx, Value{}, {}};
+  }
+  static Term mkConst(Value vlu) {
+    return Term{Kind::Const, OpCode::Const, 0, std::move(vlu), {}};
+  }
+  static Term mkOp(OpCode op, std::vector<Term> kids) {
+    return Term{Kind::Op, op, 0, Value{}, std::move(kids)};
+  }
+  bool isOp(OpCode o) const { return kind == Kind::Op && op == o; }
+};
+
+// limits so inlining does not blow up code size or recurse forever
+constexpr int MaxInlineDepth = 8;
+constexpr std::size_t MaxTermSize = 24;
+
+std::size_t termSize(const Term& term)
+{
+  std::size_t size = 1;
+  for (const auto& kid : term.kids)
+    size += termSize(kid);
+  return size;
+}
+
+/// @brief Compute a builtin at compile time, when all operands are known
+std::optional<Value> fold(OpCode op, const std::vector<Term>& kids)
+{
+  for (const auto& kid : kids)
+    if (kid.kind != Term::Kind::Const)
+      return std::nullopt;
+  auto arg = [&](std::size_t i) -> const Value& { return kids[i].vlu; };
+  // dividing by zero is left for the program to do when it runs
+  if (op == OpCode::Div && arg(1).isNum() && arg(1).asNum() == 0)
+    return std::nullopt;
+  if (op == OpCode::Rem && arg(1).isNum() &&
+      static_cast<long>(arg(1).asNum()) == 0)
+    return std::nullopt;
+  switch (op) {
+  case OpCode::Head:   return arg(0).head();
+  case OpCode::Tail:   return arg(0).tail();
+  case OpCode::Neg:    return arg(0).neg();
+  case OpCode::Len:    return arg(0).len();
+  case OpCode::Wrap:   return Value(std::vector<Value>{arg(0)});
+  case OpCode::Pair:   return Value(std::vector<Value>{arg(0), arg(1)});
+  case OpCode::Fuse:   return arg(0).fuse(arg(1));
+  case OpCode::Eq:     return Value(arg(0) == arg(1));
+  case OpCode::Add:    return arg(0) + arg(1);
+  case OpCode::Mul:    return arg(0) * arg(1);
+  case OpCode::Div:    return arg(0) / arg(1);
+  case OpCode::Rem:    return arg(0) % arg(1);
+  case OpCode::Less:   return Value(arg(1) > arg(0));
+  case OpCode::LessEq: return Value(arg(1) >= arg(0));
+  case OpCode::Skip:   return arg(1).skip(arg(0));
+  case OpCode::Nth:    return arg(1).nth(arg(0));
+  case OpCode::In:     return arg(1).contains(arg(0));
+  case OpCode::Split:  return arg(1).split(arg(0));
+  default: return std::nullopt;
+  }
+}
+
+/// @brief Rewrite list idioms such as 'head pair x y' into what they
+/// evaluate to, kids of term must already be simplified
+Term simplify(Term term)
+{
+  if (term.kind != Term::Kind::Op)
+    return term;
+  if (term.isOp(OpCode::Head) || term.isOp(OpCode::Tail)) {
+    auto& list = term.kids[0];
+    bool head = term.op == OpCode::Head;
+    if (list.isOp(OpCode::Pair)) {
+      // head pair x y is x, tail pair x y is [y]
+      if (head)
+        return std::move(list.kids[0]);
+      return simplify(Term::mkOp(OpCode::Wrap, {std::move(list.kids[1])}));
+    }
+    if (list.isOp(OpCode::Wrap)) {
+      if (head)
+        return std::move(list.kids[0]);
+      return Term::mkConst(Value(std::vector<Value>{}));
+    }
+  }
+  if (auto vlu = fold(term.op, term.kids))
+    return Term::mkConst(std::move(*vlu));
+  return term;
+}
+
+/// @brief Replace the params in term with args
+Term substitute(const Term& term, const std::vector<Term>& args)
+{
+  switch (term.kind) {
+  case Term::Kind::Const: return term;
+  case Term::Kind::Param: return args[term.param];
+  case Term::Kind::Op: break;
+  }
+  std::vector<Term> kids;
+  for (const auto& kid : term.kids)
+    kids.emplace_back(substitute(kid, args));
+  return simplify(Term::mkOp(term.op, std::move(kids)));
+}
+
+void countUses(const Term& term, std::vector<int>& uses)
+{
+  if (term.kind == Term::Kind::Param)
+    ++uses[term.param];
+  for (const auto& kid : term.kids)
+    countUses(kid, uses);
+}
+
+std::optional<Term> summarizeFn(
+  const AstFunc& fn, int depth, Chunk& chunk);
+
+/// @brief The Term for node, nullopt if it has side effects or is
+/// too complex to inline. The bodies it reads are recorded in chunk
+std::optional<Term> summarize(const AstBase& node, int depth, Chunk& chunk)
+{
+  switch (node.type()) {
+  case LangType::Value:
+    return Term::mkConst(static_cast<const AstValue*>(&node)->value());
+  case LangType::Ident:
+    return Term::mkParam(static_cast<std::uint32_t>(
+      static_cast<const AstIdent*>(&node)->localIdx()));
+  case LangType::Call: {
+    if (depth >= MaxInlineDepth)
+      return std::nullopt;
+    auto call = static_cast<const AstCall*>(&node);
+    auto callee = summarizeFn(
+      Isolate::current().funcById(call->funcId()), depth + 1, chunk);
+    if (!callee)
+      return std::nullopt;
+    std::vector<Term> args;
+    for (const auto& child : node.children()) {
+      auto arg = summarize(*child, depth, chunk);
+      if (!arg) return std::nullopt;
+      args.emplace_back(std::move(*arg));
+    }
+    // a param used more than once would compute its arg more than once
+    std::vector<int> uses(args.size(), 0);
+    countUses(*callee, uses);
+    for (std::size_t i = 0; i < args.size(); ++i)
+      if (uses[i] > 1 && args[i].kind == Term::Kind::Op)
+        return std::nullopt;
+    auto term = substitute(*callee, args);
+    if (termSize(term) > MaxTermSize)
+      return std::nullopt;
+    return term;
+  }
+  default: break;
+  }
+
+  auto op = builtinOp(node.type());
+  if (!op || !isPure(*op))
+    return std::nullopt;
+  std::vector<Term> kids;
+  for (const auto& child : node.children()) {
+    auto kid = summarize(*child, depth, chunk);
+    if (!kid) return std::nullopt;
+    kids.emplace_back(std::move(*kid));
+  }
+  return simplify(Term::mkOp(*op, std::move(kids)));
+}
+
+std::optional<Term> summarizeFn(
+  const AstFunc& fn, int depth, Chunk& chunk)
+{
+  chunk.addInlined(fn.id(), fn.bodyVersion());
+  // a body that does not parse is not inlined, its syntax error is
+  // thrown when it is first called, as without inlining
+  const AstChildren* parsed;
+  try {
+    parsed = &fn.body();
+  } catch (const SyntaxError&) {
+    return std::nullopt;
+  }
+  const auto& body = *parsed;
+  if (body.empty())
+    return Term::mkConst(Value::Null);
+  // leading expressions, such as doc strings, are thrown away
+  // so they may not have side effects either
+  for (std::size_t i = 0; i + 1 < body.size(); ++i)
+    if (!summarize(*body[i], depth, chunk))
+      return std::nullopt;
+  return summarize(*body.back(), depth, chunk);
+}
+
+/// @brief The params in the order term uses them
+void paramOrder(const Term& term, std::vector<std::uint32_t>& order)
+{
+  if (term.kind == Term::Kind::Param)
+    order.push_back(term.param);
+  for (const auto& kid : term.kids)
+    paramOrder(kid, order);
+}
+
+/// @brief Arguments that are free to evaluate any number of times
+bool isSimple(const AstBase& arg)
+{
+  return arg.type() == LangType::Ident || arg.type() == LangType::Value;
+}
+
+// -----------------------------------------------------------------
+
+class Compiler {
+  Chunk& _chunk;
+  // values on the stack above the arguments, and the most seen
+  std::size_t _depth, _maxDepth;
+
+  /// @brief Arguments of a call being inlined
+  struct InlineArgs {
+    const AstChildren& exprs;
+    // in order mode each arg is compiled where the term uses it,
+    // next is the first arg not yet evaluated
+    bool inOrder;
+    std::size_t next;
+  };
+
+  void grow(int delta) {
+    _depth += delta;
+    _maxDepth = std::max(_maxDepth, _depth);
+  }
+
+  void children(const AstBase& node) {
+    for (const auto& child : node.children())
+      expr(*child, false);
+  }
+
+  void builtin(const AstBase& node, OpCode op) {
+    children(node);
+    _chunk.emit(op);
+    // consumes all operands, pushes the result
+    grow(1 - static_cast<int>(node.children().size()));
+  }
+
+  void constant(const Value& vlu) {
+    _chunk.emit(OpCode::Const, _chunk.addConst(vlu));
+    grow(1);
+  }
+
+  /// @brief Evaluate arg only for its side effects
+  void discard(const AstBase& arg) {
+    if (isSimple(arg))
+      return;
+    expr(arg, false);
+    _chunk.emit(OpCode::Pop);
+    grow(-1);
+  }
+
+  void term(const Term& t, InlineArgs& args, bool tail) {
+    switch (t.kind) {
+    case Term::Kind::Const:
+      constant(t.vlu);
+      break;
+    case Term::Kind::Param:
+      if (args.inOrder) {
+        // args skipped by the term still runs, in their order
+        for (; args.next < t.param; ++args.next)
+          discard(*args.exprs[args.next]);
+        args.next = t.param + 1;
+      }
+      expr(*args.exprs[t.param], tail);
+      break;
+    case Term::Kind::Op:
+      for (const auto& kid : t.kids)
+        term(kid, args, false);
+      _chunk.emit(t.op);
+      grow(1 - static_cast<int>(t.kids.size()));
+      break;
+    }
+  }
+
+  /// @brief Compile the body of the called function in place,
+  /// false if it can't be inlined
+  bool inlineCall(const AstCall& call, bool tail) {
+    const auto& callee = Isolate::current().funcById(call.funcId());
+    auto t = summarizeFn(callee, 0, _chunk);
+    if (!t)
+      return false;
+
+    // arguments must be evaluated once and in order, unless
+    // they are simple enough to not matter
+    const auto& exprs = call.children();
+    std::vector<std::uint32_t> order;
+    paramOrder(*t, order);
+    bool inOrder = std::adjacent_find(order.begin(), order.end(),
+      [](auto a, auto b){ return a >= b; }) == order.end();
+    if (!inOrder && !std::all_of(exprs.begin(), exprs.end(),
+                                 [](const auto& e){ return isSimple(*e); }))
+      return false;
+
+    DEBUG("inline '" << callee.fnName() << "' in call\n");
+    InlineArgs args{exprs, inOrder, 0};
+    // such as '# x y', y is the result so it stays in tail position
+    bool tailArg = tail && inOrder && t->kind == Term::Kind::Param &&
+      t->param + 1 == exprs.size();
+    term(*t, args, tailArg);
+    if (inOrder)
+      for (; args.next < exprs.size(); ++args.next)
+        discard(*exprs[args.next]);
+    return true;
+  }
+
+public:
+  explicit Compiler(Chunk& chunk) :
+    _chunk{chunk}, _depth{0}, _maxDepth{0}
+  {}
+
+  void function(const AstFunc& fn) {
+    const auto& body = fn.body();
+    if (body.empty())
+      constant(Value::Null);
+    for (std::size_t i = 0; i < body.size(); ++i) {
+      // only the last expression is the result of this function
+      bool last = i + 1 == body.size();
+      expr(*body[i], last);
+      if (!last) {
+        _chunk.emit(OpCode::Pop);
+        grow(-1);
+      }
+    }
+    _chunk.emit(OpCode::Return);
+    _chunk.setMaxStack(static_cast<std::uint32_t>(_maxDepth));
+  }
+
+  /// @brief Compile node, tail is true when the value of node
+  /// is returned directly from this function
+  void expr(const AstBase& node, bool tail) {
+    switch (node.type()) {
+    case LangType::If: {
+      expr(node[0], false);
+      auto toElse = _chunk.emit(OpCode::JumpIfNot);
+      grow(-1);
+      auto depth = _depth;
+      expr(node[1], tail);
+      // in tail position we can return directly instead of jumping to end
+      auto toEnd = _chunk.emit(tail ? OpCode::Return : OpCode::Jump);
+      _chunk.patch(toElse, static_cast<std::uint32_t>(_chunk.size()));
+      // only one of the branches runs
+      _depth = depth;
+      expr(node[2], tail);
+      if (!tail)
+        _chunk.patch(toEnd, static_cast<std::uint32_t>(_chunk.size()));
+    } break;
+    case LangType::Call: {
+      auto call = static_cast<const AstCall*>(&node);
+      if (inlineCall(*call, tail))
+        break;
+      children(node);
+      _chunk.emit(tail ? OpCode::TailCall : OpCode::Call, call->funcId());
+      grow(1 - static_cast<int>(node.children().size()));
+    } break;
+    case LangType::Value:
+      constant(static_cast<const AstValue*>(&node)->value());
+      break;
+    case LangType::Ident: {
+      auto ident = static_cast<const AstIdent*>(&node);
+      _chunk.emit(OpCode::Arg,
+                  static_cast<std::uint32_t>(ident->localIdx()));
+      grow(1);
+    } break;
+    default:
+      if (auto op = builtinOp(node.type())) {
+        builtin(node, *op);
+        break;
+      }
+      std::cerr <<
+        "unhandled astNode.type():" << typeName(node.type()) << '\n';
+      constant(Value::Null);
+    }
+  }
+};
+
+} // namespace
+
+std::unique_ptr<Chunk> compile(const AstFunc& fn)
+{
+  auto chunk = std::make_unique<Chunk>();
+  Compiler compiler{*chunk};
+  compiler.function(fn);
+  DEBUG("compiled fn '" << fn.fnName() << "'\n" << chunk->disassemble());
+  return chunk;
+}
+
+} // namespace atto
@@ -0,0 +1,20 @@
+#ifndef ATTO_COMPILER_H
+#define ATTO_COMPILER_H
+
+#include <memory>
+#include "ast.hpp"
+#include "bytecode.hpp"
+
+namespace atto {
+
+/**
+ * @brief Compile the body of a function into a linear bytecode chunk
+ *
+ * @param fn The parsed function to compile
+ * @return The compiled chunk, runnable by Vm
+ */
+std::unique_ptr<Chunk> compile(const AstFunc& fn);
+
+} // namespace atto
+
+#endif // ATTO_COMPILER_H
@@ -0,0 +1,19 @@
+#ifndef ATTO_CORE_IMAGE_H
+#define ATTO_CORE_IMAGE_H
+
+#include <string_view>
+
+namespace atto {
+
+// generated from atto/core.at by atto_mkcore when the atto
+// executable is built
+
+/// @brief The source of the core library
+std::string_view coreSource();
+/// @brief The tokens, outline and parsed bodies of coreSource,
+/// see ModuleCache::image
+std::string_view coreImage();
+
+} // namespace atto
+
+#endif // ATTO_CORE_IMAGE_H
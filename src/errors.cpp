@@ -101,3 +101,16 @@ std::filesystem::path FileIOError::path() const
 {
   return _path;
 }
+
+// --------------------------------------------------------
+
+RuntimeError::RuntimeError(
+  std::string what, const Module& module
+) :
+  Error{what, module}
+{}
+
+std::string_view RuntimeError::typeName() const
+{
+  return "RuntimeError";
+}
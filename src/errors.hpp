@@ -117,6 +117,24 @@ public:
   std::filesystem::path path() const;
 };
 
+/**
+ * @brief Error when running code, such as a stack overflow
+ */
+class RuntimeError : public Error {
+public:
+  /**
+   * @brief Construct a new Runtime Error object
+   *
+   * @param what The error message
+   * @param module The module of the function running when it happened
+   */
+  RuntimeError(std::string what, const Module& module);
+  /**
+   * @return std::string_view The name of this error, ie. RuntimeError
+   */
+  virtual std::string_view typeName() const override;
+};
+
 } // namespace atto
 
 
@@ -0,0 +1,87 @@
+#include "isolate.hpp"
+
+using namespace atto;
+
+// static
+thread_local Isolate* Isolate::_current = nullptr;
+
+Isolate::Isolate() :
+  _symbols{}, _parseMode{ParseMode::Eager},
+  _funcNames{}, _funcTable{}, _bodyEpoch{0}, _modules{}
+{}
+
+Isolate::~Isolate()
+{
+  // modules forget their functions and names here as they go
+  Use use(*this);
+  _modules.clear();
+}
+
+Isolate::Use::Use(Isolate& isolate) :
+  _prev{_current}, _symbols{isolate._symbols}
+{
+  _current = &isolate;
+}
+
+Isolate::Use::~Use()
+{
+  _current = _prev;
+}
+
+void Isolate::setParseMode(ParseMode mode)
+{
+  _parseMode = mode;
+}
+
+ParseMode Isolate::parseMode() const
+{
+  return _parseMode;
+}
+
+Module& Isolate::module(const std::string& name,
+                        const std::filesystem::path path /* = "" */)
+{
+  auto found = _modules.find(name);
+  if (found != _modules.end())
+    return found->second;
+
+  // we can oly have one in memory, store it first, then lookup
+  _modules.emplace(std::pair<std::string, Module>{name, Module{path}});
+  auto& mod = _modules.at(name);
+  mod.load();
+
+  return mod;
+}
+
+Module& Isolate::builtin(const std::string& name, std::filesystem::path path,
+                         std::string_view code, std::string_view image)
+{
+  auto found = _modules.find(name);
+  if (found != _modules.end())
+    return found->second;
+
+  _modules.emplace(
+    std::pair<std::string, Module>{name, Module{path, std::string(code)}});
+  auto& mod = _modules.at(name);
+  mod.load(image);
+  return mod;
+}
+
+std::vector<std::string> Isolate::moduleNames() const
+{
+  std::vector<std::string> names;
+  for (const auto& [name, _] : _modules)
+    names.emplace_back(name);
+  return names;
+}
+
+std::vector<std::string_view> Isolate::funcNames(std::string_view prefix) const
+{
+  // those beginning with prefix are sorted right after it
+  std::vector<std::string_view> names;
+  for (auto it = _funcNames.lower_bound(prefix);
+       it != _funcNames.end() &&
+         it->first.substr(0, prefix.size()) == prefix; ++it)
+    names.emplace_back(it->first);
+  return names;
+}
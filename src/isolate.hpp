@@ -0,0 +1,96 @@
+#ifndef ATTO_ISOLATE_H
+#define ATTO_ISOLATE_H
+
+#include <filesystem>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "modules.hpp"
+#include "parser.hpp"
+#include "symbols.hpp"
+
+namespace atto {
+
+/**
+ * @brief An interpreter of its own, it owns the loaded modules, their
+ * functions and the symbols they are lexed with.
+ * Nothing is shared between isolates, so each may run on a thread of
+ * its own without locks. An isolate is used by one thread at a time,
+ * the thread that has a Use of it, which is where Module and Symbols
+ * looks for it.
+ */
+class Isolate {
+  friend class Module;
+  friend class ImportLoader;
+  friend class AstFunc;
+
+  LocalSymbols _symbols;
+  ParseMode _parseMode;
+  /// names of the functions in all modules, with how many modules
+  /// define each, sorted for completion
+  std::map<std::string_view, std::size_t> _funcNames;
+  /// all functions in all modules, indexed by FuncId
+  std::vector<const AstFunc*> _funcTable;
+  /// bumped when any function body changes, chunks compiled before
+  /// that might have inlined the old body
+  std::uint32_t _bodyEpoch;
+  /// last, the modules refers to all of the above
+  std::unordered_map<std::string, Module> _modules;
+
+  static thread_local Isolate* _current;
+public:
+  Isolate();
+  Isolate(const Isolate& other) = delete;
+  ~Isolate();
+  Isolate& operator=(const Isolate& other) = delete;
+
+  /// @brief Make isolate the one in use on this thread while this lives
+  class Use {
+    Isolate* _prev;
+    LocalSymbols::Use _symbols;
+  public:
+    explicit Use(Isolate& isolate);
+    Use(const Use& other) = delete;
+    ~Use();
+    Use& operator=(const Use& other) = delete;
+  };
+
+  /// @brief The isolate in use on this thread, there must be one
+  static Isolate& current() { return *_current; }
+
+  /// @brief Set how modules loaded from now on are parsed, default Eager
+  void setParseMode(ParseMode mode);
+  ParseMode parseMode() const;
+
+  /// @brief Get module name, loads it from path if it is not loaded
+  Module& module(const std::string& name,
+                 const std::filesystem::path path = "");
+
+  /// @brief Load a module that is built into the executable
+  /// @param name The name of the module
+  /// @param path Shown in errors
+  /// @param code The source code
+  /// @param image The tokens of code from ModuleCache::image,
+  ///  code is lexed if it does not fit
+  Module& builtin(const std::string& name, std::filesystem::path path,
+                  std::string_view code, std::string_view image);
+
+  /// @brief All modules loaded at this time
+  /// @return vector with names of all modules
+  std::vector<std::string> moduleNames() const;
+
+  /// @brief Functions in any module that begins with prefix
+  /// @return The names, each once and in order
+  std::vector<std::string_view> funcNames(std::string_view prefix) const;
+
+  /// @brief Get a function from any module by its id, no lookups by name
+  const AstFunc& funcById(FuncId id) const {
+    return *_funcTable[id];
+  }
+};
+
+} // namespace atto
+
+#endif // ATTO_ISOLATE_H
@@ -1,115 +1,500 @@
+#include <cstdint>
+#include <limits>
 #include "lex.hpp"
 #include "common.hpp"
 #include "errors.hpp"
 #include "modules.hpp"
 
+#if defined(__AVX2__) || defined(__SSE2__)
+# include <immintrin.h>
+#endif
+
 namespace atto {
 
-Token::Token(
-  LexTypes type,
-  const Module& module,
-  std::string_view ident,
-  int line, int col
-):
-  _line{line}, _col{col},
-  _ident{ident}
+namespace {
+
+struct Keyword {
+  std::string_view name;
+  LangType type;
+};
+
+/// All reserved words and builtins, add new builtins here
+constexpr Keyword keywords[] = {
+  {"true",     LangType::True_litr},
+  {"false",    LangType::False_litr},
+  {"null",     LangType::Null_litr},
+  {"fn",       LangType::Fn},
+  {"is",       LangType::Is},
+  {"if",       LangType::If},
+  {"__head",   LangType::Head},
+  {"__tail",   LangType::Tail},
+  {"__fuse",   LangType::Fuse},
+  {"__pair",   LangType::Pair},
+  {"__litr",   LangType::Litr},
+  {"__str",    LangType::Str},
+  {"__words",  LangType::Words},
+  {"__input",  LangType::Input},
+  {"__print",  LangType::Print},
+  {"__eq",     LangType::Eq},
+  {"__add",    LangType::Add},
+  {"__neg",    LangType::Neg},
+  {"__mul",    LangType::Mul},
+  {"__div",    LangType::Div},
+  {"__rem",    LangType::Rem},
+  {"__less",   LangType::Less},
+  {"__lesseq", LangType::LessEq},
+  {"__import", LangType::Import},
+  {"__len",    LangType::Len},
+  {"__skip",   LangType::Skip},
+  {"__nth",    LangType::Nth},
+  {"__in",     LangType::In},
+  {"__split",  LangType::Split},
+};
+constexpr std::size_t keywordCount = sizeof(keywords) / sizeof(keywords[0]);
+
+constexpr std::uint32_t keywordHash(std::string_view str, std::uint32_t seed)
+{
+  // FNV-1a
+  std::uint32_t hash = 2166136261u ^ seed;
+  for (char c : str) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/// @brief A perfect hash of keywords, each slot holds index+1 of the
+/// keyword hashing to it, 0 for empty
+struct KeywordTable {
+  static constexpr std::size_t Size = 128; // power of 2
+  std::uint32_t seed;
+  std::uint8_t slots[Size];
+};
+
+/// try seeds until one maps every keyword to its own slot
+constexpr KeywordTable makeKeywordTable()
+{
+  for (std::uint32_t seed = 0; seed < 100000; ++seed) {
+    KeywordTable table{seed, {}};
+    bool perfect = true;
+    for (std::size_t i = 0; i < keywordCount && perfect; ++i) {
+      auto& slot = table.slots[
+        keywordHash(keywords[i].name, seed) & (KeywordTable::Size - 1)];
+      perfect = slot == 0;
+      slot = static_cast<std::uint8_t>(i + 1);
+    }
+    if (perfect)
+      return table;
+  }
+  return KeywordTable{~0u, {}};
+}
+
+constexpr KeywordTable keywordTable = makeKeywordTable();
+static_assert(keywordTable.seed != ~0u,
+              "No perfect hash for keywords, increase KeywordTable::Size");
+
+/// @brief LangType for a identifier, Ident if it is not a keyword
+LangType keywordType(std::string_view ident)
+{
+  auto slot = keywordTable.slots[
+    keywordHash(ident, keywordTable.seed) & (KeywordTable::Size - 1)];
+  if (slot != 0 && keywords[slot - 1].name == ident)
+    return keywords[slot - 1].type;
+  return LangType::Ident;
+}
+
+// ----------------------------------------------------
+// byte classes, same as isspace, isdigit and isalnum in the C locale
+
+inline bool isSpace(unsigned char c)
+{
+  return c == ' ' || static_cast<unsigned char>(c - '\t') <= '\r' - '\t';
+}
+
+inline bool isDigit(unsigned char c)
+{
+  return static_cast<unsigned char>(c - '0') <= 9;
+}
+
+inline bool isIdentChar(unsigned char c)
+{
+  return isDigit(c) || static_cast<unsigned char>((c | 0x20) - 'a') <= 25 ||
+         c == '_' || c == '-';
+}
+
+inline bool isStringStop(unsigned char c)
+{
+  return c == '"' || c == '\\' || c == '\n' || c == '\0';
+}
+
+// ----------------------------------------------------
+// vector versions, each give a bitmask with one bit per byte
+
+#if defined(__AVX2__)
+# define ATTO_LEX_SIMD
+using Vec = __m256i;
+using Bits = std::uint32_t;
+constexpr std::size_t VecSize = 32;
+
+inline Vec load(const char* p) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+inline Vec splat(char c) { return _mm256_set1_epi8(c); }
+inline Vec either(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+inline Vec sub(Vec a, Vec b) { return _mm256_sub_epi8(a, b); }
+inline Vec eq(Vec a, Vec b) { return _mm256_cmpeq_epi8(a, b); }
+/// unsigned a <= b
+inline Vec lessEq(Vec a, Vec b) { return eq(_mm256_min_epu8(a, b), a); }
+inline Bits bits(Vec v) { return static_cast<Bits>(_mm256_movemask_epi8(v)); }
+
+#elif defined(__SSE2__)
+# define ATTO_LEX_SIMD
+using Vec = __m128i;
+using Bits = std::uint32_t;
+constexpr std::size_t VecSize = 16;
+
+inline Vec load(const char* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+inline Vec splat(char c) { return _mm_set1_epi8(c); }
+inline Vec either(Vec a, Vec b) { return _mm_or_si128(a, b); }
+inline Vec sub(Vec a, Vec b) { return _mm_sub_epi8(a, b); }
+inline Vec eq(Vec a, Vec b) { return _mm_cmpeq_epi8(a, b); }
+/// unsigned a <= b
+inline Vec lessEq(Vec a, Vec b) { return eq(_mm_min_epu8(a, b), a); }
+inline Bits bits(Vec v) { return static_cast<Bits>(_mm_movemask_epi8(v)); }
+#endif
+
+#ifdef ATTO_LEX_SIMD
+constexpr Bits AllBits = static_cast<Bits>((1ull << VecSize) - 1);
+
+inline Bits spaceBits(Vec v)
+{
+  return bits(either(eq(v, splat(' ')),
+                     lessEq(sub(v, splat('\t')), splat('\r' - '\t'))));
+}
+
+inline Bits digitBits(Vec v)
+{
+  return bits(lessEq(sub(v, splat('0')), splat(9)));
+}
+
+/// digits too
+inline Bits identBits(Vec v)
+{
+  auto letters = lessEq(sub(either(v, splat(0x20)), splat('a')), splat(25));
+  return bits(either(letters, either(eq(v, splat('_')),
+                                     eq(v, splat('-'))))) | digitBits(v);
+}
+
+/// @brief Byte classes of 64 bytes of source, bit n is byte n
+struct Block {
+  static constexpr std::size_t Size = 64;
+  std::uint64_t space = 0, ident = 0, digit = 0;
+
+  explicit Block(const char* p) {
+    for (std::size_t i = 0; i < Size; i += VecSize) {
+      auto v = load(p + i);
+      space   |= std::uint64_t{spaceBits(v)} << i;
+      ident   |= std::uint64_t{identBits(v)} << i;
+      digit   |= std::uint64_t{digitBits(v)} << i;
+    }
+  }
+
+  /// bits [from, to), from < Size
+  static std::uint64_t range(unsigned from, unsigned to) {
+    auto below = to < Size ? (std::uint64_t{1} << to) - 1 : ~std::uint64_t{0};
+    return below & (~std::uint64_t{0} << from);
+  }
+};
+#endif
+
+/// @brief The scanners below, each stops at the first byte
+/// not belonging to the run it skips
+struct NotSpace {
+  bool operator()(unsigned char c) const { return !isSpace(c); }
+#ifdef ATTO_LEX_SIMD
+  Bits operator()(Vec v) const { return ~spaceBits(v) & AllBits; }
+#endif
+};
+
+struct NotDigit {
+  bool operator()(unsigned char c) const { return !isDigit(c); }
+#ifdef ATTO_LEX_SIMD
+  Bits operator()(Vec v) const { return ~digitBits(v) & AllBits; }
+#endif
+};
+
+struct NotIdentChar {
+  bool operator()(unsigned char c) const { return !isIdentChar(c); }
+#ifdef ATTO_LEX_SIMD
+  Bits operator()(Vec v) const { return ~identBits(v) & AllBits; }
+#endif
+};
+
+struct StringStop {
+  bool operator()(unsigned char c) const { return isStringStop(c); }
+#ifdef ATTO_LEX_SIMD
+  Bits operator()(Vec v) const {
+    return bits(either(either(eq(v, splat('"')), eq(v, splat('\\'))),
+                       either(eq(v, splat('\n')), eq(v, splat('\0')))));
+  }
+#endif
+};
+
+/// @brief Find the first byte in [p, end) where stop is true
+template<typename Stop>
+const char* find(const char* p, const char* end, Stop stop)
 {
+#ifdef ATTO_LEX_SIMD
+  for (; static_cast<std::size_t>(end - p) >= VecSize; p += VecSize)
+    if (auto hits = stop(load(p)))
+      return p + __builtin_ctz(hits);
+#endif
+  while (p != end && !stop(static_cast<unsigned char>(*p)))
+    ++p;
+  return p;
+}
+
+/// @brief Classify and intern the token text, then add it to module
+void addToken(Module& module, LexTypes type,
+              std::string_view text, std::uint32_t offset)
+{
+  LangType tokType;
   switch (type) {
   case LexTypes::Number:
-    _tokType = LangType::Num_litr; break;
+    tokType = LangType::Num_litr; break;
   case LexTypes::String:
-    _tokType = LangType::Str_litr; break;
-  case LexTypes::Ident: {
-    auto twoFirst = ident.substr(0,2);
-    if (ident == "true")       _tokType = LangType::True_litr;
-    else if (ident == "false") _tokType = LangType::False_litr;
-    else if (ident == "null")  _tokType = LangType::Null_litr;
-    else if (ident == "fn")    _tokType = LangType::Fn;
-    else if (ident == "is")    _tokType = LangType::Is;
-    else if (ident == "if")    _tokType = LangType::If;
-    else if (twoFirst == "__") {
-      auto name = ident.substr(2);
-      if (name == "head")        _tokType = LangType::Head;
-      else if (name == "tail")   _tokType = LangType::Tail;
-      else if (name == "fuse")   _tokType = LangType::Fuse;
-      else if (name == "pair")   _tokType = LangType::Pair;
-      else if (name == "litr")   _tokType = LangType::Litr;
-      else if (name == "str")    _tokType = LangType::Str;
-      else if (name == "words")  _tokType = LangType::Words;
-      else if (name == "input")  _tokType = LangType::Input;
-      else if (name == "print")  _tokType = LangType::Print;
-      else if (name == "eq")     _tokType = LangType::Eq;
-      else if (name == "add")    _tokType = LangType::Add;
-      else if (name == "neg")    _tokType = LangType::Neg;
-      else if (name == "mul")    _tokType = LangType::Mul;
-      else if (name == "div")    _tokType = LangType::Div;
-      else if (name == "rem")    _tokType = LangType::Rem;
-      else if (name == "less")   _tokType = LangType::Less;
-      else if (name == "lesseq") _tokType = LangType::LessEq;
-      else if (name == "import") _tokType = LangType::Import;
-      else _tokType = LangType::Ident;
-    } else _tokType = LangType::Ident;
-  } break;
+    tokType = LangType::Str_litr; break;
+  case LexTypes::Ident:
+    tokType = keywordType(text); break;
   case LexTypes::Default: [[fallthrough]];
-  default:
+  default: {
+    auto [line, col] = module.lineCol(offset);
     throw SyntaxError(
-      std::string("Literal not valid: ") + std::string(ident),
-      module,
-      line, col);
+      std::string("Literal not valid: ") + std::string(text),
+      module, line, col);
+  }
   }
+  module.addToken(tokType, Symbols::intern(text), offset);
+}
+
+/// @brief The code to lex, offsets are 32 bits
+std::string_view lexCode(const Module& module, std::size_t from)
+{
+  if (module.code().size() > std::numeric_limits<std::uint32_t>::max())
+    throw SyntaxError("Source code larger than 4GB", module, 1, 0);
+  return module.code().substr(from);
+}
+
+} // namespace
+
+
+void TokenList::reserve(std::size_t size)
+{
+  _types.reserve(size);
+  _symbols.reserve(size);
+  _offsets.reserve(size);
+}
+
+void TokenList::truncate(std::size_t size)
+{
+  _types.resize(size);
+  _symbols.resize(size);
+  _offsets.resize(size);
+}
+
+void TokenList::remap(const std::vector<SymbolId>& ids)
+{
+  for (auto& symbol : _symbols)
+    symbol = ids[symbol];
+}
 
+std::size_t TokenList::memoryUsage() const
+{
+  return _types.capacity() * sizeof(LangType) +
+         _symbols.capacity() * sizeof(SymbolId) +
+         _offsets.capacity() * sizeof(std::uint32_t);
 }
 
+// ----------------------------------------------------
+
+Token::Token() :
+  _module{nullptr}, _idx{0}, _tokType{LangType::__Failure}
+{}
+
+Token::Token(const Module& module, std::size_t idx) :
+  _module{&module}, _idx{static_cast<std::uint32_t>(idx)},
+  _tokType{module.tokens().type(idx)}
+{}
+
 int Token::col() const
 {
-  return _col;
+  return _module ? _module->lineCol(offset()).second : -1;
 }
 
 int Token::line() const
 {
-  return _line;
+  return _module ? _module->lineCol(offset()).first : -1;
+}
+
+SymbolId Token::symbol() const
+{
+  return _module ? _module->tokens().symbol(_idx) : Symbols::NoSymbol;
 }
 
-LangType Token::type() const
+std::uint32_t Token::offset() const
 {
-  return _tokType;
+  return _module ? _module->tokens().offset(_idx) : 0;
 }
 
 std::string_view Token::ident() const
 {
-  return _ident;
+  return _module ? Symbols::name(symbol()) : "NaN";
 }
 
 std::string_view Token::value() const
 {
+  auto ident = this->ident();
   return _tokType == LangType::Str ?
-    _ident.substr(1,_ident.length() -1) : _ident;
+    ident.substr(1, ident.length() -1) : ident;
 }
 
 bool Token::operator==(const Token& other) const
 {
-  return _line == other._line && _col == other._col &&
-         _ident == other._ident && _tokType == other._tokType;
+  return _module == other._module && _idx == other._idx;
 }
 
 // static
 Token Token::mkFailure()
 {
-  Token tok(LexTypes::Number, Module::module("__main__"), "NaN");
-  tok._tokType = LangType::__Failure;
-  return tok;
+  return Token();
 }
 
 // ----------------------------------------------------
 
-void lex(Module &module, std::size_t from) {
+void lex(Module &module, std::size_t from)
+{
+  auto code = lexCode(module, from);
+  const char *cp = code.data(),
+             *end = code.data() + code.size();
+  if (from == 0)
+    module.reserveTokens(code.size() / 4); // a token every 4 bytes at most
+
+  auto offsetOf = [&](const char* p) {
+    return static_cast<std::uint32_t>(from + (p - code.data()));
+  };
+  auto emit = [&](LexTypes type, const char* tokBegin) {
+    std::string_view text(tokBegin, static_cast<std::size_t>(cp - tokBegin));
+    addToken(module, type, text, offsetOf(tokBegin));
+  };
+  auto syntaxError = [&](const std::string &msg){
+    auto [line, col] = module.lineCol(offsetOf(cp));
+    return SyntaxError(msg, module, line, col);
+  };
+
+  // lex the token at cp, false at a '\0' which ends the source
+  auto lexToken = [&]() {
+    const char* tokBegin = cp;
+    if (*cp == '\0')
+      return false;
+
+    if (*cp == '"') {
+      tokBegin = ++cp;
+      while ((cp = find(cp, end, StringStop{})) != end && *cp != '"') {
+        if (*cp == '\0')
+          throw syntaxError("Invalid null char in string");
+        if (*cp == '\n') {
+          ++cp;
+          continue;
+        }
+        // a escape, newlines and more '\\' may come before the 'n'
+        for (++cp; cp != end; ++cp) {
+          if (*cp == '\r' && cp + 1 != end && cp[1] == '\n')
+            ++cp;
+          else if (*cp != '\n' && *cp != '\\')
+            break;
+        }
+        if (cp == end)
+          break;
+        if (*cp == '\0')
+          throw syntaxError("Invalid null char in string");
+        if (*cp != 'n')
+          throw syntaxError("Invalid escape sequence");
+        ++cp;
+      }
+      emit(LexTypes::String, tokBegin);
+      if (cp != end)
+        ++cp; // past '"'
+    }
+    else if (isDigit(static_cast<unsigned char>(*cp))) {
+      cp = find(cp + 1, end, NotDigit{});
+      if (cp != end && !isSpace(static_cast<unsigned char>(*cp)))
+        throw syntaxError("Unexpected char in numbers literal");
+      emit(LexTypes::Number, tokBegin);
+    }
+    else { // must be a ident
+      cp = find(cp + 1, end, NotIdentChar{});
+      if (cp != end && !isSpace(static_cast<unsigned char>(*cp)))
+        throw syntaxError("Invalid char in identifier literal");
+      emit(LexTypes::Ident, tokBegin);
+    }
+    return true;
+  };
+
+#ifdef ATTO_LEX_SIMD
+  // numbers and identifiers within a block are found from its bits,
+  // strings and tokens crossing into the next block use lexToken
+  while (static_cast<std::size_t>(end - cp) >= Block::Size) {
+    const char* base = cp;
+    Block block(base);
+    unsigned pos = 0;
+    for (;;) {
+      auto starts = ~block.space & Block::range(pos, Block::Size);
+      unsigned start = starts ? __builtin_ctzll(starts) : Block::Size;
+      if (start == Block::Size) {
+        cp = base + Block::Size;
+        break;
+      }
+
+      cp = base + start;
+      auto ends = block.space & (~std::uint64_t{1} << start);
+      if (*cp == '"' || *cp == '\0' || !ends) {
+        if (!lexToken())
+          return;
+        break; // next block from cp
+      }
+
+      const char* tokBegin = cp;
+      bool number = isDigit(static_cast<unsigned char>(*cp));
+      unsigned stop = __builtin_ctzll(ends);
+      auto valid = number ? block.digit : block.ident;
+      if (auto invalid = ~valid & Block::range(start + 1, stop)) {
+        cp = base + __builtin_ctzll(invalid);
+        throw syntaxError(number ? "Unexpected char in numbers literal" :
+                                   "Invalid char in identifier literal");
+      }
+      cp = base + stop;
+      emit(number ? LexTypes::Number : LexTypes::Ident, tokBegin);
+      pos = stop;
+    }
+  }
+#endif
+
+  while ((cp = find(cp, end, NotSpace{})) != end)
+    if (!lexToken())
+      break;
+}
+
+void lexScalar(Module &module, std::size_t from) {
 
   LexTypes state{LexTypes::Default};
-  int lineNr = 1;
-  auto code = module.code().substr(from);
-  auto lineBegin = code.begin();
+  auto code = lexCode(module, from);
   const char *tokBegin = nullptr,
              *cp = nullptr;
+  auto offsetOf = [&](const char* p) {
+    return static_cast<std::uint32_t>(from + (p - code.begin()));
+  };
 
   auto startToken = [&](LexTypes s) {
     tokBegin = cp;
@@ -117,27 +502,28 @@ void lex(Module &module, std::size_t from) {
   };
   auto endToken = [&]() {
     auto ident = code.substr(tokBegin - code.begin(), cp - tokBegin);
-    int col = static_cast<int>(tokBegin - lineBegin);
-    Token tok{state, module, ident, lineNr, col};
-    module.addToken(tok);
+    addToken(module, state, ident, offsetOf(tokBegin));
     tokBegin = nullptr;
     state = LexTypes::Default;
   };
   auto syntaxError = [&](const std::string &msg){
-    int col = static_cast<int>(cp - lineBegin);
-    return SyntaxError(msg, module, lineNr, col);
+    auto [line, col] = module.lineCol(offsetOf(cp));
+    return SyntaxError(msg, module, line, col);
   };
 
   bool incr = true, escaped = false;
 
   for(cp = code.begin(); cp != code.end(); incr && ++cp) {
     incr = true;
-    if (*cp == '\r' && *(cp+1) == '\n')
+    // a mapped file has nothing after end()
+    if (*cp == '\r' && cp + 1 != code.end() && *(cp+1) == '\n') {
+      if (tokBegin && state != LexTypes::String)
+        endToken();
       continue; // make sure it is not past end()
+    }
     if (*cp == '\n') {
       if (tokBegin && state != LexTypes::String)
         endToken();
-      lineNr++; lineBegin = cp+1;
       continue; // make sure it is not past end()
     }
 
@@ -148,9 +534,8 @@ void lex(Module &module, std::size_t from) {
         incr = false;
       }
       else if (*cp == '"') {
-        ++cp;
         startToken(LexTypes::String);
-        if (*cp == '"') endToken(); // special case empty string
+        tokBegin = cp + 1; // without '"'
       }
       else if (isdigit(*cp)) startToken(LexTypes::Number);
       else if (isspace(*cp)) ; // intentional nothing
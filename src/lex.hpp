@@ -1,11 +1,13 @@
 #ifndef ATTO_LEX_H
 #define ATTO_LEX_H
 
+#include <cstdint>
 #include <string>
 #include <string_view>
 #include <vector>
 #include <memory>
 #include "common.hpp"
+#include "symbols.hpp"
 //#include "modules.hpp"
 
 namespace atto {
@@ -13,36 +15,68 @@ namespace atto {
 class Module;
 
 /**
- * @brief A token in the source code
+ * @brief The tokens of a module as parallel arrays, token n is
+ * type(n), symbol(n) and offset(n). The symbol is the interned text
+ * of the token and offset where it begins in the source code.
+ */
+class TokenList {
+  std::vector<LangType> _types;
+  std::vector<SymbolId> _symbols;
+  std::vector<std::uint32_t> _offsets;
+public:
+  void add(LangType type, SymbolId symbol, std::uint32_t offset) {
+    _types.emplace_back(type);
+    _symbols.emplace_back(symbol);
+    _offsets.emplace_back(offset);
+  }
+  void reserve(std::size_t size);
+  /// @brief Drop the tokens from size and on
+  void truncate(std::size_t size);
+  /// @brief Replace each symbol with ids[symbol], such as when the
+  /// tokens were lexed with LocalSymbols
+  void remap(const std::vector<SymbolId>& ids);
+  std::size_t size() const { return _types.size(); }
+  LangType type(std::size_t idx) const { return _types[idx]; }
+  SymbolId symbol(std::size_t idx) const { return _symbols[idx]; }
+  std::uint32_t offset(std::size_t idx) const { return _offsets[idx]; }
+  /// @return Bytes used by the tokens
+  std::size_t memoryUsage() const;
+};
+
+/**
+ * @brief A token in the source code, refers to a token in the
+ * TokenList of its module
  */
 class Token {
-  int _line, _col;
+  const Module* _module;
+  std::uint32_t _idx;
   LangType _tokType;
-  std::string_view _ident;
+  Token();
 public:
   /**
    * @brief Construct a new Token object
    *
-   * @param type What LexType this token is
-   * @param module In what module is token create
-   * @param ident The source string for this token
-   * @param line What line is the token located
-   * @param col What column is this token located in this line
+   * @param module In what module is token is
+   * @param idx The index of the token in module.tokens()
    */
-  Token(LexTypes type,
-        const Module& module,
-        std::string_view ident,
-        int line = -1, int col = -1);
-  /// @brief Get the line
+  Token(const Module& module, std::size_t idx);
+  /// @brief Get the line, derived from the offset
   /// @return The line nr
   int line() const;
   /// @brief Get the column
   /// @brief The column nr
   int col() const;
+  /// @brief Same token in the same module
   bool operator==(const Token& other) const;
   /// @brief get the type form this token
   /// @return LangType for this token
-  LangType type() const;
+  LangType type() const { return _tokType; }
+  /// @brief The interned text of this token
+  SymbolId symbol() const;
+  /// @brief Where in the source code this token begins
+  std::uint32_t offset() const;
+  /// @brief The index in module.tokens()
+  std::size_t index() const { return _idx; }
   /// @brief Get the source string for this token
   std::string_view ident() const;
   /// @brief Get the value for this token, ie no '"' for this string
@@ -54,11 +88,23 @@ public:
 /**
  * @brief Lex (Tokenize) the source code
  *
+ * Runs of whitespace, identifiers, numbers and strings are scanned
+ * with SSE2 or AVX2 when built for it, else one byte at a time.
+ *
  * @param module in what module the source is found
  * @param from From what position to begin lex
  */
 void lex(Module &module, std::size_t from = 0);
 
+/**
+ * @brief Lex one char at a time through a state machine,
+ *  gives the same tokens and errors as lex, used to verify it
+ *
+ * @param module in what module the source is found
+ * @param from From what position to begin lex
+ */
+void lexScalar(Module &module, std::size_t from = 0);
+
 } // namespace atto
 
 
@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <cstdlib>
+#include "loader.hpp"
+#include "errors.hpp"
+#include "isolate.hpp"
+#include "modules.hpp"
+
+using namespace atto;
+
+namespace {
+
+/// @brief The paths after each __import in code, found without lexing.
+/// Strings are skipped as the lexer does, so an __import in a string
+/// or doc string is not one
+std::vector<std::string_view> scanImports(std::string_view code)
+{
+  constexpr std::string_view Keyword = "__import";
+  constexpr std::string_view Space = " \t\n\v\f\r";
+  std::vector<std::string_view> paths;
+  bool afterImport = false;
+  for (auto pos = code.find_first_not_of(Space);
+       pos != std::string_view::npos;
+       pos = code.find_first_not_of(Space, pos))
+  {
+    if (code[pos] == '"') {
+      // no escape in a string may hide its closing '"'
+      auto end = code.find('"', pos + 1);
+      if (end == std::string_view::npos)
+        break;
+      if (afterImport)
+        paths.emplace_back(code.substr(pos + 1, end - pos - 1));
+      afterImport = false;
+      pos = end + 1;
+    } else {
+      auto end = code.find_first_of(Space, pos);
+      afterImport = code.substr(pos, end - pos) == Keyword;
+      pos = end;
+    }
+  }
+  return paths;
+}
+
+/// @brief How many threads to prepare imports on, none turns it off
+std::size_t maxWorkers()
+{
+  static const std::size_t workers = []() -> std::size_t {
+    if (auto env = std::getenv("ATTO_LOAD_THREADS"))
+      return std::strtoul(env, nullptr, 10);
+    // with one cpu it is the same work plus handing it over
+    auto cpus = std::thread::hardware_concurrency();
+    return cpus < 2 ? 0 : cpus;
+  }();
+  return workers;
+}
+
+} // namespace
+
+// static
+thread_local ImportLoader* ImportLoader::_active = nullptr;
+
+ImportLoader::ImportLoader(const Module& module, const Outline& defs) :
+  _mutex{}, _workCond{}, _doneCond{}, _entries{}, _queue{}, _loaded{},
+  _workers{}, _idle{0}, _stop{false}, _prev{_active}
+{
+  for (const auto& [name, mod] : Isolate::current()._modules)
+    _loaded.emplace_back(mod.path());
+  _active = this;
+  for (const auto& def : defs)
+    if (def.type == LangType::Import)
+      schedule(module, module.token(def.tok).value());
+}
+
+ImportLoader::~ImportLoader()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _workCond.notify_all();
+  for (auto& worker : _workers)
+    worker.join();
+  _active = _prev;
+}
+
+// static
+std::unique_ptr<ImportLoader> ImportLoader::begin(
+  const Module& module, const Outline& defs)
+{
+  auto imports = std::any_of(defs.begin(), defs.end(),
+    [](const Definition& def) { return def.type == LangType::Import; });
+  if (!imports || _active || maxWorkers() == 0)
+    return nullptr;
+  return std::make_unique<ImportLoader>(module, defs);
+}
+
+// static
+ImportLoader* ImportLoader::active()
+{
+  return _active;
+}
+
+std::unique_ptr<ImportLoader::Prepared>
+ImportLoader::take(const std::filesystem::path& path)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  auto found = _entries.find(path);
+  if (found == _entries.end())
+    return nullptr;
+  _doneCond.wait(lock, [&]() { return found->second.done; });
+  return std::move(found->second.prepared);
+}
+
+void ImportLoader::schedule(const Module& from, std::string_view path)
+{
+  // the same path as Module::import gets
+  std::filesystem::path fullPath = path;
+  if (fullPath.is_relative())
+    fullPath = from.path().parent_path() / fullPath;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (std::find(_loaded.begin(), _loaded.end(), fullPath) != _loaded.end() ||
+      !_entries.try_emplace(fullPath).second)
+    return;
+  _queue.emplace_back(fullPath);
+  if (_idle == 0 && _workers.size() < maxWorkers())
+    _workers.emplace_back(&ImportLoader::work, this);
+  else
+    _workCond.notify_one();
+}
+
+void ImportLoader::work()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  for (;;) {
+    ++_idle;
+    _workCond.wait(lock, [this]() { return _stop || !_queue.empty(); });
+    --_idle;
+    if (_stop)
+      return;
+    auto path = std::move(_queue.front());
+    _queue.pop_front();
+
+    lock.unlock();
+    auto prepared = prepare(path);
+    lock.lock();
+    auto& entry = _entries.at(path);
+    entry.prepared = std::move(prepared);
+    entry.done = true;
+    _doneCond.notify_all();
+  }
+}
+
+std::unique_ptr<ImportLoader::Prepared>
+ImportLoader::prepare(const std::filesystem::path& path)
+{
+  // readFile tells why it can't be read, leave that to import
+  std::error_code err;
+  if (!std::filesystem::is_regular_file(path, err) ||
+      std::filesystem::is_empty(path, err) || err)
+    return nullptr;
+
+  auto prepared = std::make_unique<Prepared>();
+  try {
+    prepared->module = std::make_unique<Module>(path);
+    auto& module = *prepared->module;
+    // begin on what this imports before it is lexed
+    for (auto import : scanImports(module.code()))
+      schedule(module, import);
+
+    LocalSymbols::Use use(prepared->symbols);
+    prepared->defs = module.prepare();
+    // those the scan did not find
+    for (const auto& def : prepared->defs)
+      if (def.type == LangType::Import)
+        schedule(module, module.token(def.tok).value());
+  } catch (Error* e) {
+    // thrown by the Module constructor, import throws it again
+    delete e;
+    return nullptr;
+  } catch (...) {
+    return nullptr;
+  }
+  return prepared;
+}
@@ -0,0 +1,90 @@
+#ifndef ATTO_LOADER_H
+#define ATTO_LOADER_H
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "parser.hpp"
+#include "symbols.hpp"
+
+namespace atto {
+
+/**
+ * @brief Reads, lexes and outlines the modules that a module imports
+ * on a pool of threads, while the thread loading it parses on.
+ *
+ * The imports of each file are found by a quick scan for __import
+ * before it is lexed, so all of a chain of imports is lexed at once.
+ * Module::import takes a prepared module when the parser gets to its
+ * import, so modules are defined in the same order as when they were
+ * loaded one by one. A module that failed to prepare is loaded again
+ * by import, which throws its error just as before.
+ * Only the loading thread touches the Isolate, workers intern names
+ * in a LocalSymbols of each module.
+ * There is a thread for each cpu, or $ATTO_LOAD_THREADS of them.
+ * With one cpu or ATTO_LOAD_THREADS=0 imports are loaded one by one.
+ */
+class ImportLoader {
+public:
+  /// @brief A module ready to be linked
+  struct Prepared {
+    std::unique_ptr<Module> module;
+    Outline defs;
+    /// the symbols of the tokens of module
+    LocalSymbols symbols;
+  };
+
+  /// @brief Begin to load what module imports, defs is its outline
+  ImportLoader(const Module& module, const Outline& defs);
+  ImportLoader(const ImportLoader& other) = delete;
+  /// @brief Waits for the workers, modules not taken are thrown away
+  ~ImportLoader();
+  ImportLoader& operator=(const ImportLoader& other) = delete;
+
+  /// @brief Begin to load what module imports, unless it is done
+  /// already for a module that imports it, there is nothing to import
+  /// or it is turned off
+  /// @param defs The outline of module
+  /// @return The loader, keep it until module is linked, or null
+  static std::unique_ptr<ImportLoader> begin(
+    const Module& module, const Outline& defs);
+  /// @brief The loader of the module being loaded on this thread,
+  /// null if none
+  static ImportLoader* active();
+  /// @brief Wait until path is prepared and take it
+  /// @return null if path was never found or failed to prepare
+  std::unique_ptr<Prepared> take(const std::filesystem::path& path);
+
+private:
+  struct Entry {
+    bool done = false;
+    std::unique_ptr<Prepared> prepared; // null if it failed
+  };
+
+  std::mutex _mutex;
+  std::condition_variable _workCond, _doneCond;
+  std::map<std::filesystem::path, Entry> _entries;
+  std::deque<std::filesystem::path> _queue;
+  /// paths of the modules in the isolate when this began
+  std::vector<std::filesystem::path> _loaded;
+  std::vector<std::thread> _workers;
+  std::size_t _idle;
+  bool _stop;
+  ImportLoader* _prev;
+
+  static thread_local ImportLoader* _active;
+
+  /// @brief Prepare the import path of from unless already done
+  void schedule(const Module& from, std::string_view path);
+  void work();
+  std::unique_ptr<Prepared> prepare(const std::filesystem::path& path);
+};
+
+} // namespace atto
+
+#endif // ATTO_LOADER_H
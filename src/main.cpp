@@ -1,6 +1,9 @@
 #include "atto.hpp"
+#include "parser.hpp"
 #include "values.hpp"
+#include <cstdlib>
 #include <iostream>
+#include <string_view>
 
 using namespace atto;
 
@@ -10,21 +13,44 @@ void printHelp()
     "Usage:\n" <<
     " atto [file]     executes file\n" <<
     " atto            runs in REPL mode\n" <<
+    " atto -t [file]  use the reference tree walking evaluator\n" <<
+    " atto -l [file]  parse functions when first called, not when loaded\n" <<
+    " atto -c core.at [file]\n" <<
+    "                 load core from core.at, not the built in core\n" <<
     " atto -h         display this help\n";
 }
 
 int main(int argc, const char *argv[]) {
-  Atto engine;
+  auto engine = Vm::Engine::Bytecode;
+  auto parseMode = ParseMode::Eager;
+  std::filesystem::path corePath;
+  int argi = 1;
+  for (; argi < argc; ++argi) {
+    std::string_view arg = argv[argi];
+    if (arg == "-t")
+      engine = Vm::Engine::TreeWalker;
+    else if (arg == "-l")
+      parseMode = ParseMode::Lazy;
+    else if (arg == "-c" && argi + 1 < argc)
+      corePath = argv[++argi];
+    else
+      break;
+  }
+
+  Atto atto(".replHistory", engine, corePath, parseMode);
 
-  if (argc == 1) {
-    engine.repl();
-  } else if (argc != 2) {
+  if (argc == argi) {
+    atto.repl();
+  } else if (argc != argi + 1) {
     printHelp();
   } else {
-    if (argv[1][0] == '-')
+    if (argv[argi][0] == '-')
       printHelp();
     else {
-      auto retVlu = engine.execFile(argv[1]);
+      auto result = atto.execFile(argv[argi]);
+      if (!result)
+        return EXIT_FAILURE;
+      const auto& retVlu = *result;
       switch (retVlu.type()) {
       case ValueTypes::Null: return 0;
       case ValueTypes::Num: return static_cast<int>(retVlu.asNum());
@@ -34,4 +60,4 @@ int main(int argc, const char *argv[]) {
       }
     }
   }
-}
\ No newline at end of file
+}
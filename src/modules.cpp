@@ -1,15 +1,21 @@
 #include "modules.hpp"
+#include "cache.hpp"
 #include "common.hpp"
 #include "errors.hpp"
+#include "isolate.hpp"
 #include "lex.hpp"
+#include "loader.hpp"
 #include "parser.hpp"
 #include <algorithm>
+#include <unordered_set>
 
 using namespace atto;
 
 Module::Module(std::filesystem::path path, const std::string& code) :
   _path{path}, _code{code}, _tokens{},
-  _imported{}, _funcs{}, _parsed{false}
+  _lineStarts{}, _linesIndexed{0},
+  _imported{}, _arena{std::make_unique<AstArena>()}, _funcs{},
+  _parsed{false}, _callees{}, _callers{}, _image{}
 {}
 
 Module::Module(std::filesystem::path path) :
@@ -33,8 +39,9 @@ Module::Module(const std::string& code) :
 
 Module::Module():
   _path{}, _code{},
-  _tokens{}, _imported{},
-  _funcs{}, _parsed{}
+  _tokens{}, _lineStarts{}, _linesIndexed{0},
+  _imported{}, _arena{std::make_unique<AstArena>()}, _funcs{}, _parsed{},
+  _callees{}, _callers{}, _image{}
 {}
 
 /*Module::Module(const Module& other):
@@ -45,11 +52,21 @@ Module::Module():
 
 Module::Module(Module&& rhs):
   _path{std::move(rhs._path)}, _code{std::move(rhs._code)},
-  _tokens{std::move(rhs._tokens)}, _imported{std::move(rhs._imported)},
-  _funcs{std::move(rhs._funcs)}, _parsed{std::move(rhs._parsed)}
-{}
+  _tokens{std::move(rhs._tokens)},
+  _lineStarts{std::move(rhs._lineStarts)}, _linesIndexed{rhs._linesIndexed},
+  _imported{std::move(rhs._imported)}, _arena{std::move(rhs._arena)},
+  _funcs{std::move(rhs._funcs)}, _parsed{std::move(rhs._parsed)},
+  _callees{std::move(rhs._callees)}, _callers{std::move(rhs._callers)},
+  _image{rhs._image}
+{
+  // they are ours now, not counted twice in the names of the isolate
+  rhs._funcs.clear();
+}
 
-Module::~Module() { }
+Module::~Module()
+{
+  forgetFuncNames();
+}
 
 /*Module& Module::operator=(const Module& other)
 {
@@ -66,8 +83,16 @@ Module& Module::operator=(Module&& rhs)
   _path = std::move(rhs._path);
   _code = std::move(rhs._code);
   _tokens = std::move(rhs._tokens);
+  _lineStarts = std::move(rhs._lineStarts);
+  _linesIndexed = rhs._linesIndexed;
   _imported = std::move(rhs._imported);
+  forgetFuncNames();
   _funcs = std::move(rhs._funcs);
+  rhs._funcs.clear();
+  _arena = std::move(rhs._arena);
+  _callees = std::move(rhs._callees);
+  _callers = std::move(rhs._callers);
+  _image = rhs._image;
   return *this;
 }
 
@@ -77,10 +102,46 @@ void Module::parse(Module &mod, std::string modName)
   if (modName.size() == 0)
     modName = mod._path.stem();
   // we can only have one in memory, take ownership
-  Module::_allModules[modName] = std::move(mod);
-  atto::lex(mod);
-  atto::parse(mod);
-  mod._parsed = true;
+  auto& stored = Isolate::current()._modules[modName];
+  if (&stored != &mod)
+    stored = std::move(mod);
+  stored.load();
+}
+
+void Module::load(std::string_view image)
+{
+  auto defs = prepare(image);
+  // the calls in the bodies of image are to the FuncIds our functions
+  // got when it was made, as when core is the first module loaded
+  if (!_image.empty() && ModuleCache::funcBase(_image) !=
+                         Isolate::current()._funcTable.size())
+    _image = {};
+  // what it imports is prepared on other threads while this is linked
+  auto loader = ImportLoader::begin(*this, defs);
+  link(defs);
+}
+
+Outline Module::prepare(std::string_view image)
+{
+  Outline defs;
+  auto cached = image.empty() ? ModuleCache::load(*this, defs) :
+                                ModuleCache::load(*this, image, defs);
+  if (cached && !image.empty())
+    _image = image;
+  if (!cached) {
+    atto::lex(*this);
+    defs = atto::outline(*this);
+    if (image.empty())
+      ModuleCache::store(*this, defs);
+  }
+  return defs;
+}
+
+void Module::link(const Outline& defs)
+{
+  indexCalls(defs);
+  atto::parse(*this, defs);
+  _parsed = true;
 }
 
 bool Module::isParsed() const
@@ -95,30 +156,152 @@ const std::filesystem::path& Module::path() const
 
 std::string_view Module::code() const
 {
-  return _code;
+  return _code.view();
+}
+
+void Module::indexCalls(const Outline& defs)
+{
+  // calls are found by name in the body tokens, so bodies not
+  // parsed yet are found too
+  for (const auto& def : defs) {
+    if (def.type != LangType::Fn)
+      continue;
+    auto fn = _tokens.symbol(def.tok);
+    // a redefinition may call others than before
+    auto& callees = _callees[fn];
+    for (auto callee : callees)
+      _callers[callee].erase(fn);
+    callees.clear();
+    for (auto tok = def.body;
+         tok < _tokens.size() && _tokens.type(tok) != LangType::Fn; ++tok)
+    {
+      if (_tokens.type(tok) != LangType::Ident)
+        continue;
+      auto callee = _tokens.symbol(tok);
+      if (_callers[callee].insert(fn).second)
+        callees.emplace_back(callee);
+    }
+  }
+}
+
+std::vector<SymbolId> Module::relinkCallers(
+  const Outline& defs,
+  const std::unordered_map<SymbolId, std::size_t>& arity)
+{
+  std::vector<SymbolId> touched;
+  std::unordered_set<SymbolId> isTouched;
+  std::vector<SymbolId> resolveAgain;
+  for (const auto& def : defs) {
+    if (def.type != LangType::Fn)
+      continue;
+    auto fn = _tokens.symbol(def.tok);
+    if (!isTouched.insert(fn).second)
+      continue;
+    touched.emplace_back(fn);
+    auto old = arity.find(fn);
+    if (old == arity.end() || old->second != _funcs.at(fn).second.size())
+      resolveAgain.emplace_back(fn);
+  }
+
+  // their calls were resolved to the function this replaced, those
+  // in defs are parsed already
+  for (auto fn : resolveAgain) {
+    auto callers = _callers.find(fn);
+    if (callers == _callers.end())
+      continue;
+    for (auto caller : callers->second) {
+      auto def = _funcs.find(caller);
+      if (def == _funcs.end() || isTouched.count(caller))
+        continue;
+      auto func = const_cast<AstFunc*>(def->second.first.get());
+      func->setBody(func->bodyTok());
+    }
+  }
+
+  // callers of callers, each function once
+  for (std::size_t i = 0; i < touched.size(); ++i) {
+    auto callers = _callers.find(touched[i]);
+    if (callers == _callers.end())
+      continue;
+    for (auto caller : callers->second)
+      if (_funcs.count(caller) && isTouched.insert(caller).second)
+        touched.emplace_back(caller);
+  }
+  return touched;
 }
 
-void Module::appendCode(const std::string code)
+std::vector<SymbolId> Module::appendCode(const std::string code)
 {
-  auto prevEnd = _code.size();
-  _code += code;
-  if (_parsed) {
+  // each append begins a new line, so errors points to the right input
+  auto text = _code.view();
+  if (!text.empty() && text.back() != '\n')
+    _code.append("\n");
+  auto prevEnd = _code.view().size();
+  _code.append(code);
+  if (!_parsed)
+    return {};
+
+  // only the new code, what was defined before stays as it is
+  auto fromTok = _tokens.size();
+  Outline defs;
+  try {
     atto::lex(*this, prevEnd);
-    atto::parse(*this);
+    defs = atto::outline(*this, fromTok);
+  } catch (...) {
+    // the code is kept so the error can show it, but not its tokens
+    _tokens.truncate(fromTok);
+    throw;
+  }
+
+  // params of the functions that are redefined, as they were
+  std::unordered_map<SymbolId, std::size_t> arity;
+  for (const auto& def : defs) {
+    if (def.type != LangType::Fn)
+      continue;
+    auto fn = _funcs.find(_tokens.symbol(def.tok));
+    if (fn != _funcs.end())
+      arity.emplace(fn->first, fn->second.second.size());
   }
+  indexCalls(defs);
+  atto::parse(*this, defs);
+  return relinkCallers(defs, arity);
 }
 
-void Module::addToken(const Token &tok)
+void Module::reserveTokens(std::size_t size)
 {
-  _tokens.emplace_back(std::move(tok));
+  _tokens.reserve(size);
 }
 
-const std::vector<Token>&
+const TokenList&
 Module::tokens() const
 {
   return _tokens;
 }
 
+Token Module::token(std::size_t idx) const
+{
+  return Token(*this, idx);
+}
+
+std::pair<int, int> Module::lineCol(std::uint32_t offset) const
+{
+  // index what has been added to code since last time, once all
+  // is indexed this only reads, as Program relies on
+  auto text = _code.view();
+  if (_lineStarts.empty() || _linesIndexed < text.size()) {
+    if (_lineStarts.empty())
+      _lineStarts.emplace_back(0);
+    for (auto pos = text.find('\n', _linesIndexed);
+         pos != std::string_view::npos; pos = text.find('\n', pos + 1))
+      _lineStarts.emplace_back(static_cast<std::uint32_t>(pos + 1));
+    _linesIndexed = text.size();
+  }
+
+  auto next = std::upper_bound(_lineStarts.begin(), _lineStarts.end(), offset);
+  auto line = static_cast<int>(next - _lineStarts.begin());
+  return {line, static_cast<int>(offset - *(next - 1))};
+}
+
 
 const FuncMap&
 Module::funcs() const
@@ -129,11 +312,11 @@ Module::funcs() const
 const AstFunc&
 Module::func(const std::string& fn) const
 {
-  return *_funcs.at(fn).first.get();
+  return *_funcs.at(Symbols::find(fn)).first.get();
 }
 
 FuncDef&
-Module::funcDef(const std::string& fn)
+Module::funcDef(SymbolId fn)
 {
   return _funcs.at(fn);
 }
@@ -141,21 +324,31 @@ Module::funcDef(const std::string& fn)
 const FuncParams&
 Module::funcParams(const std::string& fn) const
 {
-  return _funcs.at(fn).second;
+  return _funcs.at(Symbols::find(fn)).second;
 }
 
 bool Module::hasFunc(const std::string& fn) const
 {
-
-  for (const auto& f : _funcs)
-    if (f.first == fn)
-      return true;
-  return false;
+  return _funcs.find(Symbols::find(fn)) != _funcs.end();
 }
 
-void Module::addFunc(const std::string& fn, FuncDef& def)
+void Module::addFunc(SymbolId fn, FuncDef& def)
 {
-  _funcs.emplace(std::pair<std::string, FuncDef>{fn, std::move(def)});
+  // we need to set id, ast is const once stored in module
+  auto func = const_cast<AstFunc*>(def.first.get());
+  auto& isolate = Isolate::current();
+  auto found = _funcs.find(fn);
+  if (found != _funcs.end()) {
+    // redefined, reuse slot
+    func->setId(found->second.first->id());
+    found->second = std::move(def);
+  } else {
+    func->setId(static_cast<FuncId>(isolate._funcTable.size()));
+    isolate._funcTable.emplace_back(nullptr);
+    _funcs.emplace(fn, std::move(def));
+    ++isolate._funcNames[Symbols::name(fn)];
+  }
+  isolate._funcTable[func->id()] = func;
 }
 
 void Module::import(std::filesystem::path path)
@@ -165,16 +358,36 @@ void Module::import(std::filesystem::path path)
     path = p / path;
   }
 
-  // already imported?
-  for (const auto& m : Module::_allModules)
-    if (m.second.path() == path) return;
+  // already loaded, by this or another module?
+  auto& modules = Isolate::current()._modules;
+  for (const auto& [name, mod] : modules) {
+    if (mod.path() == path) {
+      if (std::find(_imported.begin(), _imported.end(), name) ==
+          _imported.end())
+        _imported.emplace_back(name);
+      return;
+    }
+  }
+
+  // lexed already on another thread?
+  auto loader = ImportLoader::active();
+  auto prepared = loader ? loader->take(path) : nullptr;
+  if (prepared) {
+    auto [stored, isNew] = modules.emplace(
+      path.stem(), std::move(*prepared->module));
+    if (isNew) {
+      auto& mod = stored->second;
+      mod._tokens.remap(prepared->symbols.intern());
+      mod.link(prepared->defs);
+      _imported.emplace_back(path.stem());
+      return;
+    }
+  }
 
-  bool success = false;
-  const auto code = readFile(path, success);
- // we can oly have one in memory, store it first, then lookup
-  Module::_allModules.emplace(
+  // we can oly have one in memory, store it first, then lookup
+  modules.emplace(
     std::pair<std::string, Module>{path.stem(), Module{path}});
-  auto& mod = Module::_allModules.at(path.stem());
+  auto& mod = modules.at(path.stem());
   Module::parse(mod);
   _imported.emplace_back(path.stem());
 }
@@ -185,33 +398,15 @@ Module::imported() const
   return _imported;
 }
 
-//static
-std::unordered_map<std::string, Module> Module::_allModules{};
-
-// static
-std::vector<std::string> Module::allModuleNames()
+void Module::forgetFuncNames()
 {
-  std::vector<std::string> names;
-  for (const auto& [name, _] : Module::_allModules)
-    names.emplace_back(name);
-  return names;
-}
-
-// static
-Module& Module::module(const std::string& name,
-                       const std::filesystem::path path /* = "" */)
-{
-  auto found = Module::_allModules.find(name);
-  if (found != Module::_allModules.end())
-    return found->second;
-
-  // we can oly have one in memory, store it first, then lookup
-  Module::_allModules.emplace(
-    std::pair<std::string, Module>{name, Module{path}});
-  auto& mod = Module::_allModules.at(name);
-  atto::lex(mod);
-  atto::parse(mod);
-  mod._parsed = true;
-
-  return mod;
+  // one that was never linked may not be in any isolate
+  if (_funcs.empty())
+    return;
+  auto& names = Isolate::current()._funcNames;
+  for (const auto& fn : _funcs) {
+    auto found = names.find(Symbols::name(fn.first));
+    if (found != names.end() && --found->second == 0)
+      names.erase(found);
+  }
 }
@@ -5,26 +5,66 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include "lex.hpp"
 #include "ast.hpp"
 
 namespace atto {
 
+struct Definition;
+/// @brief The definitions in a module, see outline in parser.hpp
+using Outline = std::vector<Definition>;
+
 /**
  * @brief A Module is a source file loaded by the engine.
- * All different scripts are loaded as a module
+ * All different scripts are loaded as a module, into the Isolate
+ * in use on the thread that loads them
  */
 class Module {
+  friend class ImportLoader;
+  friend class Isolate;
 private:
   std::filesystem::path _path;
-  std::string _code;
-  std::vector<Token> _tokens;
+  Source _code;
+  TokenList _tokens;
+  /// offset where each line begins, built when first needed
+  mutable std::vector<std::uint32_t> _lineStarts;
+  mutable std::size_t _linesIndexed;
   std::vector<std::string> _imported;
-  std::unordered_map<std::string, FuncDef> _funcs;
+  /// the AST of all function bodies
+  std::unique_ptr<AstArena> _arena;
+  FuncMap _funcs;
   bool _parsed;
+  /// the names in the body tokens of each function, and the reverse:
+  /// the functions that has each name in their body, they may call it
+  std::unordered_map<SymbolId, std::vector<SymbolId>> _callees;
+  std::unordered_map<SymbolId, std::unordered_set<SymbolId>> _callers;
+  /// the image built into the executable this was loaded from,
+  /// function bodies are made from it instead of parsed
+  std::string_view _image;
 
+  /// @brief Lex and parse the code, the tokens are taken from
+  /// image or else ModuleCache when they have them
+  void load(std::string_view image = {});
+  /// @brief The first half of load, the tokens and outline of the code.
+  /// Does not touch other modules, so it may run on any thread
+  Outline prepare(std::string_view image = {});
+  /// @brief The second half of load, import and define what is in defs
+  void link(const Outline& defs);
+  /// @brief Remove the functions of this module from the names
+  /// in the isolate
+  void forgetFuncNames();
+  /// @brief Update _callees and _callers for the functions in defs
+  void indexCalls(const Outline& defs);
+  /// @brief Parse the bodies that call a function in defs again, if
+  /// that function is new or has other params than in arity
+  /// @return The functions in defs and all that call them
+  std::vector<SymbolId> relinkCallers(
+    const Outline& defs,
+    const std::unordered_map<SymbolId, std::size_t>& arity);
+  /// @brief Store mod in the isolate as modName and load it
   static
-  std::unordered_map<std::string, Module> _allModules;
+  void parse(Module& mod, std::string modName = "");
 public:
   /**
    * @brief Construct a new Module object
@@ -62,45 +102,49 @@ public:
   /// @brief Get the code for this module as
   /// @return String view for the code in this module
   std::string_view code() const;
-  /// @brief Append code to module, used by repl
+  /// @brief Append code to module, used by repl. Only the new code is
+  /// lexed and parsed, on a syntax error its tokens are dropped again
   /// @param code The code to append
-  void appendCode(const std::string code); // for REPL
-  /// @brief Add a token to the tokens in this module, module takes ownership
-  void addToken(const Token &tok);
+  /// @return The functions it defines and those that call them
+  std::vector<SymbolId> appendCode(const std::string code); // for REPL
+  /// @brief Add a token to the tokens in this module, used by lex
+  void addToken(LangType type, SymbolId symbol, std::uint32_t offset) {
+    _tokens.add(type, symbol, offset);
+  }
+  /// @brief Make room for size tokens
+  void reserveTokens(std::size_t size);
   /// @brief Get all tokens stored in this module
-  const std::vector<Token>& tokens() const;
+  const TokenList& tokens() const;
+  /// @brief Get token idx
+  Token token(std::size_t idx) const;
+  /// @brief Line and column of offset in the code
+  /// @return line from 1 and column from 0
+  std::pair<int, int> lineCol(std::uint32_t offset) const;
+  /// @brief Where the AST of this module is stored
+  AstArena& arena() const { return *_arena; }
+  /// @brief The image this was loaded from, see Isolate::builtin.
+  /// Empty when it was lexed or loaded from the cache
+  std::string_view image() const { return _image; }
   /// @brief Get all functions in this module
   const FuncMap& funcs() const;
   /// @brief Get the function fn in this module, throws if not found
   const AstFunc& func(const std::string& fn) const;
   /// @brief Get the function def as a writable ref from this module, throws if not found
-  FuncDef& funcDef(const std::string& fn);
+  FuncDef& funcDef(SymbolId fn);
   /// @brief Get function params
   const FuncParams& funcParams(const std::string& fn) const;
   /// @brief Find out if fn exists in this module
   bool hasFunc(const std::string& fn) const;
-  /// @brief add a function to this module, used by parser
-  void addFunc(const std::string& fn, FuncDef& def);
+  /// @brief add a function to this module, used by parser.
+  /// A redefinition replaces the previous function but keeps its FuncId,
+  /// so calls resolved to the old definition reaches the new one.
+  void addFunc(SymbolId fn, FuncDef& def);
   /// @brief import path into this module, loads and parse if necessary
   void import(std::filesystem::path path);
   /// @brief All modules currently imported to this module.
-  /// use as key to allModules to retrieve the actual module.
+  /// use as key to Isolate::module to retrieve the actual module.
   /// @return All module names currently imported to this module
   const std::vector<std::string>& imported() const;
-
-
-
-  /// @brief AllModules loaded to VM at this time
-  /// @return vector with names of all modules
-  static
- std::vector<std::string> allModuleNames();
-
-  static
-  void parse(Module& mod, std::string modName = "");
-
-  static
-  Module& module(const std::string& name,
-                const std::filesystem::path path = "");
 };
 
 } // namespace atto
@@ -5,16 +5,17 @@
 #include <sstream>
 #include "parser.hpp"
 #include "errors.hpp"
+#include "isolate.hpp"
 #include "modules.hpp"
 #include "ast.hpp"
 
-#define DEBUG(x) do { std::cerr << x; } while (0)
-//#define DEBUG(x)
+//#define DEBUG(x) do { std::cerr << x; } while (0)
+#define DEBUG(x)
 
 namespace atto {
 
-// the module being parsed
-static Module* _curModule;
+// the module being parsed on this thread
+static thread_local const Module* _curModule;
 
 
 
@@ -22,94 +23,102 @@ static Module* _curModule;
 // actual parser down below
 
 void expect(
-  std::string_view msg,
-  const Token& tok,
+  std::string_view msg, const Module& module,
+  std::size_t tok, std::size_t endTok,
   LangType type)
 {
-  if (tok.type() != type)
-    throw SyntaxError(msg.data(), *_curModule, tok);
+  // at end, point at the last token
+  if (tok == endTok)
+    throw SyntaxError(msg.data(), module, module.token(tok - 1));
+  if (module.tokens().type(tok) != type)
+    throw SyntaxError(msg.data(), module, module.token(tok));
 }
 
-AstBasePtr parse_expr(
-  std::vector<Token>::const_iterator& tok,
-  std::vector<Token>::const_iterator& endTok,
-  FuncDef& func_def, int depth = 0)
+// children of the nodes being parsed, each level uses the end of it
+static thread_local std::vector<const AstBase*> _childStack;
+
+const AstBase* parse_expr(
+  std::size_t& tok,
+  std::size_t endTok,
+  const FuncParams& args, int depth = 0)
 {
-  auto beginTok = *tok;
-  if (tok == endTok || tok->type() == LangType::Fn)
+  const auto& toks = _curModule->tokens();
+  // a missing operand may have stepped past the end
+  if (tok >= endTok || toks.type(tok) == LangType::Fn)
     return nullptr;
-
-  auto type = tok->type();
-  std::vector<AstBasePtr> children;
-  std::stringstream ss;
-  DEBUG(tok->line() << " " <<  tok->ident() <<" enter: "<<depth<<'\n');
-
-  if (tok == endTok)
-    return std::make_unique<AstBase>(*tok, LangType::__Finished, children);
+  const auto beginTok = _curModule->token(tok);
+  auto& arena = _curModule->arena();
+
+  auto type = beginTok.type();
+  // our children goes after this
+  const auto mark = _childStack.size();
+  auto child = [&]() {
+    auto expr = parse_expr(++tok, endTok, args, depth+1);
+    _childStack.emplace_back(expr);
+  };
+  // error if a child is missing, ie. not for args to functions
+  std::string_view missingErr;
+  DEBUG(beginTok.line() << " " <<  beginTok.ident() <<" enter: "<<depth<<'\n');
 
   // handle one sub thing expressions
   if (type >= LangType::List && type <= LangType::Tail) {
-    children.emplace_back(parse_expr(++tok, endTok, func_def, depth+1));
+    child();
     DEBUG("Leave single out '"<<beginTok.ident()<<"' "<<depth << "\n");
 
   } else if (type >= LangType::Fuse &&
              type <= LangType::LessEq)
   { // handle 2
-    children.emplace_back(parse_expr(++tok, endTok, func_def, depth+1));
-    children.emplace_back(parse_expr(++tok, endTok, func_def, depth+1));
+    child();
+    child();
     DEBUG("Leave 2 stuff '"<<beginTok.ident()<<"' "<<depth<<"\n");
 
   } else if (type == LangType::If) {
     // handle if stuff
-    children.emplace_back(parse_expr(++tok, endTok, func_def, depth+1));
-    children.emplace_back(parse_expr(++tok, endTok, func_def, depth+1));
-    children.emplace_back(parse_expr(++tok, endTok, func_def, depth+1));
+    child();
+    child();
+    child();
     DEBUG("leave '"<<beginTok.ident()<<"'"<<depth<<" \n");
-    ss << "Expected 'operator first second' as condition to if.";
+    missingErr = "Expected 'operator first second' as condition to if.";
 
   } else if (type >= LangType::Value && type <= LangType::Str_litr) {
     DEBUG("Leave epsilon '"<<beginTok.ident()<<"' " << depth << "\n");
-    return std::make_unique<AstValue>(beginTok, Value(beginTok));
+    return arena.make<AstValue>(beginTok, Value(beginTok));
 
   } else if (type == LangType::Ident) {
-    auto& args = func_def.second;
-    auto arg = std::find(args.begin(), args.end(), tok->ident());
+    auto arg = std::find(args.begin(), args.end(), toks.symbol(tok));
     if (arg != args.end()) {
       //found in argument params
-      DEBUG("found '" << tok->ident() << "' in args\n");
-      return std::make_unique<AstIdent>(*tok, arg - args.begin());
+      DEBUG("found '" << beginTok.ident() << "' in args\n");
+      return arena.make<AstIdent>(beginTok, arg - args.begin());
     }
     // handle function names lookup
     auto lookupFn = [&] (
-      std::vector<Token>::const_iterator& tok,
-      Module& module
-    ) -> AstBasePtr {
-      const std::unordered_map<std::string, FuncDef>&
-        func_defs = module.funcs();
-
-      auto fn = std::find_if(func_defs.begin(), func_defs.end(),
-        [&](const auto& func) -> bool {
-          return func.first == tok->ident();
-        }
-      );
+      std::size_t& tok,
+      const Module& module
+    ) -> const AstBase* {
+      const auto& func_defs = module.funcs();
+      auto fn = func_defs.find(toks.symbol(tok));
 
       if (fn != func_defs.end()) {
         // found in function definitions
-        std::vector<AstBasePtr> params;
-        const auto& args = fn->second.second;
-        const auto& callTok = *tok;
-        DEBUG("args for '" << callTok.ident() << "' num args:" << args.size() << '\n');
-        for (const auto& _ : args) {
-          DEBUG("get arg "<< _ <<"\n"); (void)_;
-          auto expr = parse_expr(++tok, endTok, func_def, depth+1);
+        const auto& fnArgs = fn->second.second;
+        DEBUG("args for '" << beginTok.ident() << "' num args:" << fnArgs.size() << '\n');
+        for (std::size_t i = 0; i < fnArgs.size(); ++i) {
+          DEBUG("get arg "<< Symbols::name(fnArgs[i]) <<"\n");
+          auto expr = parse_expr(++tok, endTok, args, depth+1);
           if (!expr || expr->isFailed()) {
-            ss << "Expected " << args.size() << " arguments in " << fn->first << " call.";
-            throw ParseError(ss.str(), *_curModule, callTok);
+            _childStack.resize(mark);
+            std::stringstream ss;
+            ss << "Expected " << fnArgs.size() << " arguments in "
+               << Symbols::name(fn->first) << " call.";
+            throw ParseError(ss.str(), *_curModule, beginTok);
           }
-          params.emplace_back(std::move(expr));
+          _childStack.emplace_back(expr);
         }
-        return std::make_unique<AstCall>(
-          beginTok, std::move(params), fn->first, module);
+        auto params = arena.link(_childStack.data() + mark, fnArgs.size());
+        _childStack.resize(mark);
+        return arena.make<AstCall>(
+          beginTok, params, fn->first, module, fn->second.first->id());
       }
       return nullptr;
     };
@@ -118,103 +127,163 @@ AstBasePtr parse_expr(
     auto thisMod = lookupFn(tok, *_curModule);
     if (thisMod) return thisMod;
 
-    auto core = lookupFn(tok, Module::module("__core__"));
+    auto& isolate = Isolate::current();
+    auto core = lookupFn(tok, isolate.module("__core__"));
     if (core) return core;
 
     // search in imported modules
     for (const auto& mod : _curModule->imported()) {
-      auto found = lookupFn(tok, _curModule->module(mod));
+      auto found = lookupFn(tok, isolate.module(mod));
       if (found) return found;
     }
 
     // if not found throw error
-    ss << "Function " << tok->ident() << " not found.";
-    throw ParseError(ss.str(), *_curModule, *tok);
+    throw ParseError("Function " + std::string(beginTok.ident()) +
+                     " not found.", *_curModule, beginTok);
   }
 
   // make sure sure we have expected sub children
-  for (auto& ast : children) {
+  auto count = _childStack.size() - mark;
+  for (auto i = mark; i < _childStack.size(); ++i) {
+    auto ast = _childStack[i];
     if (!ast || ast->isFailed()) {
-      auto s = ss.str();
-      if (s.length())
-        throw SyntaxError(s, *_curModule, beginTok);
+      _childStack.resize(mark);
+      if (missingErr.length())
+        throw SyntaxError(std::string(missingErr), *_curModule, beginTok);
       return nullptr;
     }
   }
-  return std::make_unique<AstBase>(beginTok, type, children);
+  auto children = arena.link(_childStack.data() + mark, count);
+  _childStack.resize(mark);
+  return arena.make<AstBase>(beginTok, type, children);
 }
 
-void parse(Module& module, std::size_t fromTok) {
-
-  auto end = module.tokens().end();
-  auto tok = module.tokens().begin();
-  for(std::size_t i = 0; i < fromTok && tok != end; ++i)
-    ++tok;
-
-  std::unordered_map<std::string, const Token*> funcExprsStarts;
+Outline outline(const Module& module, std::size_t fromTok)
+{
+  const auto& toks = module.tokens();
+  auto end = toks.size();
+  auto tok = std::min(fromTok, end);
+  Outline defs;
 
   for (; tok != end; ++tok) {
-    while (tok->type() == LangType::Import) {
-      const std::filesystem::path path = (++tok)->value();
-      module.import(path);
+    while (tok != end && toks.type(tok) == LangType::Import) {
+      expect("Expected path to import.", module, ++tok, end,
+             LangType::Str_litr);
+      defs.push_back({LangType::Import, static_cast<std::uint32_t>(tok), 0});
       ++tok;
     }
-    // set back to our main module after imports are done
-    _curModule = &module;
+    if (tok == end)
+      break;
 
-    expect("Expected 'fn' keyword.", *tok,  LangType::Fn);
+    expect("Expected 'fn' keyword.", module, tok, end, LangType::Fn);
     auto tokFnName = ++tok;
-
-    expect("Expected function name.", *tokFnName, LangType::Ident);
-    std::string fnName{tokFnName->ident()};
-    std::vector<std::string> args;
+    expect("Expected function name.", module, tokFnName, end, LangType::Ident);
 
     // arguments
-    while ((++tok)->type() != LangType::Is) {
-      expect("Expected parameter.", *tok, LangType::Ident);
-      args.emplace_back(tok->ident());
+    while (++tok != end && toks.type(tok) != LangType::Is)
+      expect("Expected parameter.", module, tok, end, LangType::Ident);
+    if (tok == end)
+      throw SyntaxError("Expected 'is' keyword", module,
+                        module.token(tokFnName));
+    defs.push_back({LangType::Fn, static_cast<std::uint32_t>(tokFnName),
+                    static_cast<std::uint32_t>(++tok)});
+
+    // move to next fn
+    if (tok == end)
+      break;
+    while (tok + 1 != end && toks.type(tok + 1) != LangType::Fn)
+      ++tok;
+  }
+  return defs;
+}
+
+void parse(Module& module, std::size_t fromTok)
+{
+  parse(module, outline(module, fromTok));
+}
+
+void parse(Module& module, const Outline& defs)
+{
+  const auto& toks = module.tokens();
+
+  // functions defined in this pass, in order, with where their body begins
+  struct PendingFn {
+    FuncDef* def;
+    std::size_t body;
+  };
+  std::vector<PendingFn> pending;
+  std::unordered_map<SymbolId, std::size_t> pendingIdx;
+
+  for (const auto& def : defs) {
+    if (def.type == LangType::Import) {
+      const std::filesystem::path path = module.token(def.tok).value();
+      module.import(path);
+      continue;
     }
-    expect("Expected 'is' keyword", *tok, LangType::Is);
+
+    auto fnName = toks.symbol(def.tok);
+    FuncParams args;
+    for (auto tok = def.tok + 1; tok + 1 < def.body; ++tok)
+      args.emplace_back(toks.symbol(tok));
 
     // store function definition before parsing function body
     // recursive function
-    FuncDef funcDef{std::make_unique<AstFunc>(*tokFnName, args), args};
+    FuncDef funcDef{
+      std::make_unique<AstFunc>(module.token(def.tok), args, module), args};
     module.addFunc(fnName, funcDef);
-    DEBUG("defining fn '" << fnName << " " << join(args, " ") << "'\n");
-
-    funcExprsStarts.emplace(
-      std::pair<std::string, const Token*>(fnName, &*(++tok)));
-
-    // move to next fn
-    while ((tok+1) != end && (tok+1)->type() != LangType::Fn)
-      ++tok;
+    DEBUG("defining fn '" << Symbols::name(fnName) << "'\n");
+
+    // a redefinition replaces the body too
+    PendingFn fn{&module.funcDef(fnName), def.body};
+    auto [idx, isNew] = pendingIdx.try_emplace(fnName, pending.size());
+    if (isNew)
+      pending.emplace_back(fn);
+    else
+      pending[idx->second] = fn;
   }
 
   // now that all functions has been defined, parse them
   // we must define them before parse to make sure we have the signatures
-  for (auto& fnItm : module.funcs()) {
-    const auto& fnName = fnItm.first;
-    auto& funcDef = module.funcDef(fnName);
-    DEBUG("parsing fn '" << fnName << "'\n");
-    auto& tokens = module.tokens();
-    auto tok = std::find_if(tokens.begin(), tokens.end(),
-      [&](const Token& tok) {
-        return tok == *funcExprsStarts[fnName];
-      });
-    std::vector<AstBasePtr> fnExprs;
-    do {
-      auto expr = parse_expr(tok, end, funcDef);
-      if (expr) fnExprs.emplace_back(std::move(expr));
-    } while (++tok != end && tok->type() != LangType::Fn);
-
+  auto eager = Isolate::current().parseMode() == ParseMode::Eager;
+  for (auto& fn : pending) {
     // we want it as a const normally,
-    // but we have to add children after construction
-    auto func = const_cast<AstFunc*>(&*funcDef.first);
-    func->addChildren(std::move(fnExprs));
+    // but we have to add the body after construction
+    auto func = const_cast<AstFunc*>(&*fn.def->first);
+    func->setBody(fn.body);
+    if (eager)
+      func->body();
+  }
+}
+
+AstChildren parseBody(
+  const Module& module, std::size_t body, const FuncParams& args)
+{
+  // a lazy body may be parsed while another module is
+  auto prevModule = _curModule;
+  _curModule = &module;
+  const auto& toks = module.tokens();
+  auto end = toks.size();
+  DEBUG("parsing fn at token " << body << "\n");
+  std::vector<const AstBase*> fnExprs;
+  try {
+    for (auto tok = body; tok != end && toks.type(tok) != LangType::Fn;
+         ++tok)
+    {
+      auto expr = parse_expr(tok, end, args);
+      if (expr) fnExprs.emplace_back(expr);
+      if (tok >= end) break;
+    }
+  } catch (...) {
+    // the parse stopped half way, forget what it left on the stack
+    _childStack.clear();
+    _curModule = prevModule;
+    throw;
   }
+  _curModule = prevModule;
+  return module.arena().link(fnExprs.data(), fnExprs.size());
 }
 
-Module* curModule()
+const Module* curModule()
 {
   return _curModule;
 }
@@ -5,10 +5,38 @@
 
 namespace atto {
 
+/// @brief A top level import or function definition, found by
+/// the first pass of parse
+struct Definition {
+  LangType type;      // Import or Fn
+  std::uint32_t tok;  // the path or the function name
+  std::uint32_t body; // where the function body begins, Is + 1
+};
+
 // parses all tokens in module from startTok
 void parse(Module& module, std::size_t startTok = 0);
 
-Module* curModule();
+/// @brief Find all definitions in module from startTok, throws on
+/// syntax errors outside of function bodies
+Outline outline(const Module& module, std::size_t startTok = 0);
+
+/// @brief Import and define everything in definitions, then parse the
+/// function bodies, or leave them to AstFunc::body in lazy mode.
+/// defs must be the outline of module
+void parse(Module& module, const Outline& defs);
+
+/// @brief Parse the function body beginning at token body in module
+/// @param args The parameters of the function
+AstChildren parseBody(
+  const Module& module, std::size_t body, const FuncParams& args);
+
+/// @brief When function bodies are parsed
+enum class ParseMode {
+  Eager, // when the module is loaded
+  Lazy   // when the function is first called or compiled
+};
+
+const Module* curModule();
 
 
 } // namespace atto
@@ -0,0 +1,62 @@
+#include "program.hpp"
+#include "core_image.hpp"
+#include <unordered_set>
+
+using namespace atto;
+
+Program::Program(std::filesystem::path path, std::filesystem::path corePath) :
+  _constants{}, _isolate{}, _main{nullptr}, _funcs{}
+{
+  Isolate::Use use(_isolate);
+  if (corePath.empty())
+    _isolate.builtin("__core__", "core.at", coreSource(), coreImage());
+  else
+    _isolate.module("__core__", corePath);
+  _main = &_isolate.module("__main__", path);
+
+  // what is done on first use is done now for all that the script
+  // may call, so running it writes nothing but the values of each vm
+  std::vector<const AstBase*> todo;
+  std::unordered_set<FuncId> frozen;
+  auto reach = [&](const AstFunc& fn) {
+    if (!frozen.insert(fn.id()).second)
+      return;
+    fn.freeze();
+    for (const auto& constant : fn.code().constants())
+      _constants.add(constant);
+    todo.emplace_back(&fn);
+  };
+  for (const auto& [name, def] : _main->funcs()) {
+    _funcs.emplace(Symbols::name(name), def.first.get());
+    reach(*def.first);
+  }
+  while (!todo.empty()) {
+    auto node = todo.back();
+    todo.pop_back();
+    if (node->type() == LangType::Call)
+      reach(_isolate.funcById(static_cast<const AstCall*>(node)->funcId()));
+    else if (node->type() == LangType::Value)
+      // the tree walker returns these as they are
+      _constants.add(static_cast<const AstValue*>(node)->value());
+    for (auto child : node->children())
+      todo.emplace_back(child);
+  }
+
+  // errors may point into any of them
+  for (const auto& name : _isolate.moduleNames())
+    _isolate.module(name).lineCol(0);
+}
+
+bool Program::hasFunc(const std::string& fn) const
+{
+  return _funcs.count(fn) != 0;
+}
+
+Value Program::call(Vm& vm, const std::string& fn,
+                    const std::vector<Value>& args) const
+{
+  const auto& func = *_funcs.at(fn);
+  // a Use only points this thread to the isolate, it is not changed
+  Isolate::Use use(const_cast<Isolate&>(_isolate));
+  return vm.call(func, args);
+}
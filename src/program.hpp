@@ -0,0 +1,57 @@
+#ifndef ATTO_PROGRAM_H
+#define ATTO_PROGRAM_H
+
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "isolate.hpp"
+#include "values.hpp"
+#include "vm.hpp"
+
+namespace atto {
+
+/**
+ * @brief A script with core and what it imports, parsed and compiled
+ * once to be run by any number of Vms, on any threads at once.
+ * Each Vm has its own stack and values, the functions, their bytecode
+ * and constants are shared and never changed. Nothing is loaded or
+ * compiled once it is made, so it only reads its Isolate.
+ */
+class Program {
+  /// before the isolate, so they are freed after what refers to them
+  Immortals _constants;
+  Isolate _isolate;
+  const Module* _main;
+  /// the functions of the script by name, so a call looks up nothing
+  /// in the isolate
+  std::unordered_map<std::string, const AstFunc*> _funcs;
+public:
+  /**
+   * @brief Load, parse and compile the script at path
+   *
+   * @param path The script, its module is named __main__
+   * @param corePath Load core from this file instead of the core
+   *  built into the executable
+   */
+  explicit Program(std::filesystem::path path,
+                   std::filesystem::path corePath = "");
+  Program(const Program& other) = delete;
+  Program& operator=(const Program& other) = delete;
+
+  /// @brief Find out if the script defines fn
+  bool hasFunc(const std::string& fn) const;
+
+  /// @brief Call fn in the script on vm, the value returned must not
+  /// outlive this program
+  /// @param vm Only used by one thread at a time
+  /// @param fn The function to call, throws if not found
+  /// @param args The arguments to fn
+  /// @return The value fn evaluated to
+  Value call(Vm& vm, const std::string& fn = "main",
+             const std::vector<Value>& args = {}) const;
+};
+
+} // namespace atto
+
+#endif // ATTO_PROGRAM_H
@@ -0,0 +1,175 @@
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "symbols.hpp"
+
+namespace atto {
+
+/// @brief Open addressing hash table from name to SymbolId,
+/// names are copied into blocks that are never moved or freed
+class SymbolTable {
+  struct Slot {
+    std::uint32_t hash;
+    SymbolId id; // NoSymbol when empty
+  };
+  static constexpr std::size_t BlockSize = 64 * 1024;
+
+  std::vector<Slot> _slots;
+  std::vector<std::string_view> _names;
+  std::vector<std::unique_ptr<char[]>> _blocks;
+  char* _block = nullptr; // where small names go
+  std::size_t _blockUsed = BlockSize;
+
+  static std::uint32_t hashOf(std::string_view name) {
+    // FNV-1a, names are short
+    std::uint32_t hash = 2166136261u;
+    for (char c : name) {
+      hash ^= static_cast<unsigned char>(c);
+      hash *= 16777619u;
+    }
+    return hash;
+  }
+
+  std::string_view store(std::string_view name) {
+    if (name.size() > BlockSize / 4) {
+      // big ones get their own block
+      _blocks.emplace_back(new char[name.size()]);
+      std::memcpy(_blocks.back().get(), name.data(), name.size());
+      return {_blocks.back().get(), name.size()};
+    }
+    if (_blockUsed + name.size() > BlockSize) {
+      _blocks.emplace_back(new char[BlockSize]);
+      _block = _blocks.back().get();
+      _blockUsed = 0;
+    }
+    auto dest = _block + _blockUsed;
+    std::memcpy(dest, name.data(), name.size());
+    _blockUsed += name.size();
+    return {dest, name.size()};
+  }
+
+  void grow() {
+    std::vector<Slot> old(_slots.empty() ? 1024 : _slots.size() * 2,
+                          Slot{0, Symbols::NoSymbol});
+    old.swap(_slots);
+    auto mask = _slots.size() - 1;
+    for (const auto& slot : old) {
+      if (slot.id == Symbols::NoSymbol)
+        continue;
+      auto idx = slot.hash & mask;
+      while (_slots[idx].id != Symbols::NoSymbol)
+        idx = (idx + 1) & mask;
+      _slots[idx] = slot;
+    }
+  }
+
+public:
+  /// a lookup only reads, so threads may look up in a table that is
+  /// not added to anymore
+  SymbolId find(std::string_view name, bool add) {
+    if (_slots.empty() && !add)
+      return Symbols::NoSymbol;
+    if (_slots.empty())
+      grow();
+    auto hash = hashOf(name);
+    auto mask = _slots.size() - 1;
+    for (auto idx = hash & mask; ; idx = (idx + 1) & mask) {
+      auto& slot = _slots[idx];
+      if (slot.id == Symbols::NoSymbol) {
+        if (!add)
+          return Symbols::NoSymbol;
+        // at most half full, so a probe always ends at an empty slot
+        if ((_names.size() + 1) * 2 > _slots.size()) {
+          grow();
+          return find(name, add);
+        }
+        slot = {hash, static_cast<SymbolId>(_names.size())};
+        _names.emplace_back(store(name));
+        return slot.id;
+      }
+      if (slot.hash == hash && _names[slot.id] == name)
+        return slot.id;
+    }
+  }
+
+  std::string_view name(SymbolId id) const { return _names[id]; }
+  std::size_t size() const { return _names.size(); }
+};
+
+namespace {
+
+SymbolTable& processTable()
+{
+  // never destroyed, so names are there for as long as anything
+  // refers to them, also during exit
+  static SymbolTable& tbl = *new SymbolTable;
+  return tbl;
+}
+
+// a LocalSymbols in use on this thread, else null
+thread_local SymbolTable* _local = nullptr;
+
+SymbolTable& table()
+{
+  return _local ? *_local : processTable();
+}
+
+} // namespace
+
+// static
+SymbolId Symbols::intern(std::string_view name)
+{
+  return table().find(name, true);
+}
+
+// static
+SymbolId Symbols::find(std::string_view name)
+{
+  return table().find(name, false);
+}
+
+// static
+std::string_view Symbols::name(SymbolId id)
+{
+  return table().name(id);
+}
+
+// static
+std::size_t Symbols::size()
+{
+  return table().size();
+}
+
+// ---------------------------------------------------
+
+LocalSymbols::LocalSymbols() :
+  _table{std::make_unique<SymbolTable>()}
+{}
+
+LocalSymbols::LocalSymbols(LocalSymbols&& other) = default;
+
+LocalSymbols::~LocalSymbols() = default;
+
+LocalSymbols& LocalSymbols::operator=(LocalSymbols&& other) = default;
+
+LocalSymbols::Use::Use(LocalSymbols& symbols) :
+  _prev{_local}
+{
+  _local = symbols._table.get();
+}
+
+LocalSymbols::Use::~Use()
+{
+  _local = _prev;
+}
+
+std::vector<SymbolId> LocalSymbols::intern() const
+{
+  auto& to = table();
+  std::vector<SymbolId> ids(_table->size());
+  for (std::size_t i = 0; i < ids.size(); ++i)
+    ids[i] = to.find(_table->name(static_cast<SymbolId>(i)), true);
+  return ids;
+}
+
+} // namespace atto
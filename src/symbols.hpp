@@ -0,0 +1,71 @@
+#ifndef ATTO_SYMBOLS_H
+#define ATTO_SYMBOLS_H
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace atto {
+
+/// Index of a interned name, see Symbols
+using SymbolId = std::uint32_t;
+
+/**
+ * @brief The symbol table, every distinct identifier and literal
+ * text is stored once and known by its SymbolId.
+ * Names are never removed, views returned by name stays valid.
+ * Each thread works on the table in use on it, the one of its Isolate
+ * or a LocalSymbols, else a table for the process. None are locked.
+ */
+class Symbols {
+public:
+  /// @brief Returned by find when name has not been interned
+  static constexpr SymbolId NoSymbol = ~SymbolId{0};
+
+  /// @brief Get the id for name, adds it if it is new
+  static SymbolId intern(std::string_view name);
+  /// @brief Get the id for name without adding it
+  /// @return The id or NoSymbol
+  static SymbolId find(std::string_view name);
+  /// @brief The text of symbol id
+  static std::string_view name(SymbolId id);
+  /// @return How many symbols there are
+  static std::size_t size();
+};
+
+class SymbolTable;
+
+/**
+ * @brief A symbol table of its own, such as the one of an Isolate or
+ * one to lex a module in on another thread than the one loading it.
+ * While a Use of it is alive Symbols on that thread works on this
+ * table instead, its ids are only valid in it.
+ */
+class LocalSymbols {
+  std::unique_ptr<SymbolTable> _table;
+public:
+  LocalSymbols();
+  LocalSymbols(LocalSymbols&& other);
+  ~LocalSymbols();
+  LocalSymbols& operator=(LocalSymbols&& other);
+
+  /// @brief Symbols on this thread uses symbols while this lives
+  class Use {
+    SymbolTable* _prev;
+  public:
+    explicit Use(LocalSymbols& symbols);
+    Use(const Use& other) = delete;
+    ~Use();
+    Use& operator=(const Use& other) = delete;
+  };
+
+  /// @brief Intern all names in the Symbols of this thread, which
+  /// must be another table than this
+  /// @return The SymbolId in Symbols for each local id
+  std::vector<SymbolId> intern() const;
+};
+
+} // namespace atto
+
+#endif // ATTO_SYMBOLS_H
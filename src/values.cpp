@@ -1,6 +1,10 @@
 
 #include <sstream>
 #include <memory>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <unordered_set>
 #include "values.hpp"
 #include "common.hpp"
 
@@ -10,112 +14,205 @@
 
 namespace atto {
 
-Value::Value(const Value& other) :
-  _type{other._type}, _vlu{other._vlu}
-{
-  switch(other._type) {
-  case ValueTypes::Null: break;
-  case ValueTypes::List: _vlu = other.clone()._vlu; break;
-  default:
-    _vlu = other._vlu;
+namespace {
+
+struct StrObj : HeapObj {
+  std::string str;
+  StrObj(std::string s) :
+    HeapObj{1, ValueTypes::Str}, str{std::move(s)}
+  {}
+};
+
+} // namespace
+
+struct ListBuf {
+  std::uint32_t refs;
+  std::vector<Value> items;
+};
+
+namespace {
+
+/// A view of items [begin, begin+size) in buf
+struct ListObj : HeapObj {
+  ListBuf* buf;
+  std::size_t begin, size;
+  ListObj(ListBuf* b, std::size_t from, std::size_t n) :
+    HeapObj{1, ValueTypes::List}, buf{b}, begin{from}, size{n}
+  {
+    if (buf->refs != HeapObj::Immortal)
+      ++buf->refs;
+  }
+  ~ListObj() {
+    // an immortal one goes after its buffer, see Immortals
+    if (refs != HeapObj::Immortal && buf->refs != HeapObj::Immortal &&
+        --buf->refs == 0)
+      delete buf;
+  }
+  const Value* data() const { return buf->items.data() + begin; }
+  /// true if no one has appended to buf after this slice, and
+  /// no other thread may read buf
+  bool atEnd() const {
+    return begin + size == buf->items.size() &&
+           buf->refs != HeapObj::Immortal;
   }
+};
+
+} // namespace
+
+std::uint64_t Value::boxNum(double value)
+{
+  if (std::isnan(value))
+    return CanonicalNaN;
+  std::uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
 }
 
-Value::Value(const Token& tok)
+Value::Value(HeapObj* obj) :
+  _bits{PtrTag | reinterpret_cast<std::uint64_t>(obj)}
+{}
+
+Value::Value(const Token& tok) :
+  _bits{NullBits}
 {
   switch (tok.type()) {
   case LangType::True_litr: [[fallthrough]];
   case LangType::False_litr:
-    _type = ValueTypes::Bool;
-    _vlu = tok.value() == "true";
+    _bits = tok.value() == "true" ? TrueBits : FalseBits;
     break;
   case LangType::Num_litr:
-    _type = ValueTypes::Num;
-    _vlu = std::stod(std::string(tok.value()));
+    _bits = boxNum(std::stod(std::string(tok.value())));
     break;
   case LangType::Str_litr:
-    _type = ValueTypes::Str;
-    _vlu = std::string(tok.value());
+    *this = Value(tok.value());
     break;
   case LangType::Null_litr:  [[fallthrough]];
   default:
-    _type = ValueTypes::Null; break;
-    _vlu = nullptr;
+    break;
   }
 }
 
-Value::Value(Value&& rhs) :
-  _type{std::move(rhs._type)}, _vlu{std::move(rhs.clone()._vlu)}
-{}
-
-Value::Value() :
-  _type{ValueTypes::Null}, _vlu{}
-{}
-
 Value::Value(double value) :
-  _type{ValueTypes::Num}, _vlu{value}
+  _bits{boxNum(value)}
 {}
 
-Value::Value(bool value) :
-  _type{ValueTypes::Bool}, _vlu{value}
+Value::Value(std::string_view value) :
+  Value{static_cast<HeapObj*>(new StrObj(std::string(value)))}
 {}
 
-Value::Value(std::string_view value) :
-  _type{ValueTypes::Str}, _vlu{std::string(value)}
+Value::Value(std::string value) :
+  Value{static_cast<HeapObj*>(new StrObj(std::move(value)))}
 {}
 
 Value::Value(std::vector<Value> value) :
-  _type{ValueTypes::List}
+  Value{}
+{
+  auto size = value.size();
+  *this = slice(new ListBuf{0, std::move(value)}, 0, size);
+}
+
+Value Value::slice(ListBuf* buf, std::size_t begin, std::size_t size)
+{
+  return Value{static_cast<HeapObj*>(new ListObj(buf, begin, size))};
+}
+
+bool Value::holds(const ListBuf* buf) const
 {
-  std::vector<Value> cpy;
-  for (const auto& v : value)
-    cpy.emplace_back(v.clone());
-  _vlu = cpy;
+  if (!isList())
+    return false;
+  // all items of a buffer are searched, not only those in the slice,
+  // as others may have appended lists to it past our end.
+  // Buffers may be reached more than once, each is searched once
+  std::vector<const ListBuf*> todo{static_cast<const ListObj*>(obj())->buf};
+  std::unordered_set<const ListBuf*> seen{todo.back()};
+  while (!todo.empty()) {
+    auto items = todo.back();
+    todo.pop_back();
+    for (const auto& item : items->items) {
+      if (!item.isList())
+        continue;
+      auto l = static_cast<const ListObj*>(item.obj());
+      if (l->buf == buf)
+        return true;
+      if (seen.insert(l->buf).second)
+        todo.emplace_back(l->buf);
+    }
+  }
+  return false;
 }
 
-Value::~Value() {
+void Value::destroy()
+{
   DEBUG("Delete " << typeName() << " "<< asStr()<< '\n');
+  // freeing a list releases its items, which may free lists in turn.
+  // Those are queued by the outermost destroy instead of recursing,
+  // so a deeply nested list does not use up the C++ stack
+  static thread_local std::vector<HeapObj*>* pending = nullptr;
+  auto o = obj();
+  _bits = NullBits;
+  if (pending) {
+    pending->emplace_back(o);
+    return;
+  }
+  std::vector<HeapObj*> queue;
+  pending = &queue;
+  for (;;) {
+    if (o->type == ValueTypes::Str)
+      delete static_cast<StrObj*>(o);
+    else
+      delete static_cast<ListObj*>(o);
+    if (queue.empty())
+      break;
+    o = queue.back();
+    queue.pop_back();
+  }
+  pending = nullptr;
 }
 
-Value& Value::operator=(const Value& other)
+const std::string& Value::str() const
 {
-  _type = other._type;
-  _vlu = other._vlu;
-  return *this;
+  return static_cast<const StrObj*>(obj())->str;
 }
 
-Value& Value::operator=(Value&& rhs)
+const Value* Value::listData() const
 {
-  _type = std::move(rhs._type);
-  _vlu = std::move(rhs._vlu);
-  return *this;
+  return static_cast<const ListObj*>(obj())->data();
+}
+
+std::size_t Value::listSize() const
+{
+  return static_cast<const ListObj*>(obj())->size;
 }
 
 bool Value::operator==(const Value& other) const
 {
-  if (_type != other._type) return false;
-  switch (_type) {
+  if (type() != other.type()) return false;
+  switch (type()) {
   case ValueTypes::Null: return true;
-  case ValueTypes::Bool:
-    return std::get<bool>(_vlu) == std::get<bool>(other._vlu);
-  case ValueTypes::Str:
-    return std::get<std::string>(_vlu) == std::get<std::string>(other._vlu);
-  case ValueTypes::Num:
-    return std::get<double>(_vlu) == std::get<double>(other._vlu);
-  case ValueTypes::List: return false;
+  case ValueTypes::Bool: return _bits == other._bits;
+  case ValueTypes::Str:  return str() == other.str();
+  case ValueTypes::Num:  return asNum() == other.asNum();
+  case ValueTypes::List: {
+    auto size = listSize();
+    if (size != other.listSize()) return false;
+    auto l = listData(), r = other.listData();
+    if (l == r) return true;
+    for (std::size_t i = 0; i < size; ++i)
+      if (!(l[i] == r[i])) return false;
+    return true;
+  }
   }
   return false;
 }
 
 bool Value::operator>(const Value& other) const
 {
-  if (_type != other._type) return false;
-  switch (_type) {
+  if (type() != other.type()) return false;
+  switch (type()) {
   case ValueTypes::Null: return false;
-  case ValueTypes::Bool: [[fallthrough]];
-  case ValueTypes::Str: [[fallthrough]];
-  case ValueTypes::Num:
-    return std::get<double>(_vlu) > std::get<double>(other._vlu);
+  case ValueTypes::Bool: return asBool() > other.asBool();
+  case ValueTypes::Str:  return str() > other.str();
+  case ValueTypes::Num:  return asNum() > other.asNum();
   case ValueTypes::List: return false;
   }
   return false;
@@ -130,42 +227,42 @@ bool Value::operator>=(const Value& other) const
 
 Value Value::operator+(const Value& other) const
 {
-  if (_type == ValueTypes::Num && other._type == ValueTypes::Num) {
-    return Value{std::get<double>(_vlu) + std::get<double>(other._vlu)};
-  } else if (_type == ValueTypes::Str && other._type == ValueTypes::Str) {
-    return Value{std::get<std::string>(_vlu) + std::get<std::string>(other._vlu)};
+  if (isNum() && other.isNum()) {
+    return Value{asNum() + other.asNum()};
+  } else if (isStr() && other.isStr()) {
+    return Value{str() + other.str()};
   }
   return Value::Null;
 }
 
 Value Value::operator-(const Value& other) const
 {
-  if (_type == ValueTypes::Num && other._type == ValueTypes::Num) {
-    return Value{std::get<double>(_vlu) - std::get<double>(other._vlu)};
+  if (isNum() && other.isNum()) {
+    return Value{asNum() - other.asNum()};
   }
   return Value::Null;
 }
 
 Value Value::operator/(const Value& other) const
 {
-  if (_type == ValueTypes::Num && other._type == ValueTypes::Num) {
-    return Value{std::get<double>(_vlu) / std::get<double>(other._vlu)};
+  if (isNum() && other.isNum()) {
+    return Value{asNum() / other.asNum()};
   }
   return Value::Null;
 }
 
 Value Value::operator*(const Value& other) const
 {
-  if (_type == ValueTypes::Num && other._type == ValueTypes::Num) {
-    return Value{std::get<double>(_vlu) * std::get<double>(other._vlu)};
+  if (isNum() && other.isNum()) {
+    return Value{asNum() * other.asNum()};
   }
   return Value::Null;
 }
 
 Value Value::operator%(const Value& other) const
 {
-  if (_type == ValueTypes::Num && other._type == ValueTypes::Num) {
-    auto l = std::get<double>(_vlu), r = std::get<double>(other._vlu);
+  if (isNum() && other.isNum()) {
+    auto l = asNum(), r = other.asNum();
     long res = static_cast<long>(l) % static_cast<long>(r);
     return Value{static_cast<double>(res)};
   }
@@ -174,15 +271,15 @@ Value Value::operator%(const Value& other) const
 
 Value Value::operator!() const
 {
-  switch (_type) {
+  switch (type()) {
   case ValueTypes::Bool:
-    return Value{!std::get<bool>(_vlu)};
+    return Value{!asBool()};
   case ValueTypes::Num:
-    return Value{!std::get<double>(_vlu)};
+    return Value{!asNum()};
   case ValueTypes::Str:
-    return Value{std::get<std::string>(_vlu).size() > 0};
+    return Value{str().size() > 0};
   case ValueTypes::List:
-    return Value{std::get<std::vector<Value>>(_vlu).size() > 0};
+    return Value{listSize() > 0};
   default:
     return Value{false};
   }
@@ -190,20 +287,216 @@ Value Value::operator!() const
 
 Value Value::neg() const
 {
-  switch (_type) {
+  switch (type()) {
   case ValueTypes::Num: return Value(-asNum());
   default: return Value::Null;
   }
 }
 
+Value Value::head() const
+{
+  if (isList()) {
+    if (listSize() == 0)
+      return Value::Null;
+    return listData()[0];
+  } else if (isStr()) {
+    return Value(utf8_substr(str(), 0, 1));
+  }
+  return *this;
+}
+
+Value Value::tail() const
+{
+  if (isList()) {
+    auto l = static_cast<const ListObj*>(obj());
+    if (l->size == 0)
+      return *this;
+    // share the items with this list
+    return slice(l->buf, l->begin + 1, l->size - 1);
+  } else if (isStr()) {
+    const auto& s = str();
+    if (s.size() < 2) return Value::Null;
+    return Value(utf8_substr(s, 1));
+  }
+  return *this;
+}
+
+Value Value::fuse(const Value& other) const
+{
+  std::size_t otherSize = other.isList() ? other.listSize() : 1;
+  if (isList()) {
+    auto l = static_cast<const ListObj*>(obj());
+    if (otherSize == 0)
+      return *this;
+    if (l->size == 0 && other.isList())
+      return other;
+
+    // other may hold a slice of our buffer, appended to it the buffer
+    // would hold itself and never be freed
+    if (l->atEnd() && !other.holds(l->buf)) {
+      // nobody else sees items past our end, append in place
+      auto& items = l->buf->items;
+      auto needed = items.size() + otherSize;
+      if (items.capacity() < needed)
+        items.reserve(std::max(needed, 2 * items.capacity()));
+      if (other.isList()) {
+        // index, other might be a slice of this buffer
+        auto r = static_cast<const ListObj*>(other.obj());
+        for (std::size_t i = 0; i < otherSize; ++i)
+          items.emplace_back(r->buf->items[r->begin + i]);
+      } else
+        items.emplace_back(other);
+      return slice(l->buf, l->begin, l->size + otherSize);
+    }
+  }
+
+  std::vector<Value> items;
+  items.reserve((isList() ? listSize() : 1) + otherSize);
+  auto fill = [&](const Value& from){
+    if (from.isList())
+      items.insert(items.end(), from.listData(),
+                   from.listData() + from.listSize());
+    else
+      items.emplace_back(from);
+  };
+  fill(*this);
+  fill(other);
+  return Value(std::move(items));
+}
+
+namespace {
+
+/// @brief Get n as a count, false if n is not a whole number >= 0.
+/// A countdown with such n never reaches 0 in core.at.
+/// Counts above limit are all passed the end, they are limit
+bool toCount(const Value& n, std::size_t limit, std::size_t& count)
+{
+  if (!n.isNum()) return false;
+  auto vlu = n.asNum();
+  if (!std::isfinite(vlu) || !(vlu >= 0) || std::floor(vlu) != vlu)
+    return false;
+  // compared as doubles, only a vlu that fits is cast
+  count = vlu >= static_cast<double>(limit) ?
+    limit : static_cast<std::size_t>(vlu);
+  return true;
+}
+
+} // namespace
+
+Value Value::len() const
+{
+  if (isList())
+    return Value(static_cast<double>(listSize()));
+  if (isStr())
+    // "" counts as an atom too
+    return Value(static_cast<double>(std::max<std::size_t>(
+      utf8_len(str()), 1)));
+  return Value(1.0);
+}
+
+Value Value::skip(const Value& n) const
+{
+  std::size_t count = 0;
+  if (isList()) {
+    // passed the end gives the empty list
+    auto size = listSize();
+    if (!toCount(n, size, count)) count = size;
+    auto l = static_cast<const ListObj*>(obj());
+    return slice(l->buf, l->begin + count, size - count);
+  } else if (isStr()) {
+    // strings stops at the last letter, it is an atom
+    const auto& s = str();
+    auto len = utf8_len(s);
+    if (len < 2) return *this;
+    if (!toCount(n, len - 1, count)) count = len - 1;
+    if (count == 0) return *this;
+    return Value(std::string_view(s).substr(utf8_offset(s, count)));
+  }
+  return *this;
+}
+
+Value Value::nth(const Value& n) const
+{
+  std::size_t count = 0;
+  if (isList())
+    return toCount(n, listSize(), count) ? at(count) : Value::Null;
+  else if (isStr()) {
+    // stops at the last letter, same as skip
+    const auto& s = str();
+    auto len = utf8_len(s);
+    if (len < 2) return *this;
+    if (!toCount(n, len - 1, count)) count = len - 1;
+    auto from = utf8_offset(s, count);
+    return Value(std::string_view(s).substr(
+      from, utf8_offset(s, count + 1) - from));
+  }
+  return *this;
+}
+
+Value Value::contains(const Value& x) const
+{
+  if (!isList()) return Value(false);
+  for (const auto& item : listView())
+    if (x == item)
+      return Value(true);
+  return Value(false);
+}
+
+Value Value::split(const Value& idx) const
+{
+  std::size_t count = 0;
+  if (isList()) {
+    auto size = listSize();
+    if (size == 0)
+      return *this;
+    bool valid = toCount(idx, size, count);
+    std::vector<Value> first;
+    auto items = listData();
+    auto addItem = [&](const Value& item) {
+      // fuse flattens items that are lists
+      if (item.isList())
+        first.insert(first.end(), item.listData(),
+                     item.listData() + item.listSize());
+      else
+        first.emplace_back(item);
+    };
+    if (valid && count < size) {
+      for (std::size_t i = 0; i < count; ++i)
+        addItem(items[i]);
+      return Value(std::vector<Value>{
+        Value(std::move(first)), skip(idx)});
+    }
+    // ran into the end before idx, the empty list splits into null
+    for (std::size_t i = 0; i < size; ++i)
+      addItem(items[i]);
+    first.emplace_back(Value::Null);
+    return Value(std::vector<Value>{Value(std::move(first)), Value::Null});
+  }
+
+  // tail on strings and atoms never gives a empty list,
+  // only a countdown to 0 stops it
+  std::vector<Value> first;
+  if (!toCount(idx, first.max_size(), count))
+    return Value::Null;
+  Value rest = *this;
+  for (std::size_t i = 0; i < count; ++i) {
+    first.emplace_back(rest.head());
+    rest = rest.tail();
+  }
+  return Value(std::vector<Value>{Value(std::move(first)), rest});
+}
+
 ValueTypes Value::type() const
 {
-  return _type;
+  if (isNum()) return ValueTypes::Num;
+  if (isPtr()) return obj()->type;
+  if (isNull()) return ValueTypes::Null;
+  return ValueTypes::Bool;
 }
 
 std::string_view Value::typeName() const
 {
-  switch (_type) {
+  switch (type()) {
   case ValueTypes::Null: return "Null";
   case ValueTypes::Bool: return "Bool";
   case ValueTypes::Str:  return "Str";
@@ -216,62 +509,84 @@ std::string_view Value::typeName() const
 
 bool Value::asBool() const
 {
-  switch(_type) {
-  case ValueTypes::Bool: return std::get<bool>(_vlu);
+  switch(type()) {
+  case ValueTypes::Bool: return _bits == TrueBits;
   case ValueTypes::Null: return false;
-  case ValueTypes::Num:  return std::get<double>(_vlu) != 0.0;
-  case ValueTypes::Str:  return std::get<std::string>(_vlu).size() > 0;
-  case ValueTypes::List: return std::get<std::vector<Value>>(_vlu).size() > 0;
+  case ValueTypes::Num:  return asNum() != 0.0;
+  case ValueTypes::Str:  return str().size() > 0;
+  case ValueTypes::List: return listSize() > 0;
   }
   return false;
 }
 
 double Value::asNum() const
 {
-  switch(_type) {
-  case ValueTypes::Bool: return std::get<bool>(_vlu) ? 1.0 : 0.0;
+  switch(type()) {
+  case ValueTypes::Bool: return asBool() ? 1.0 : 0.0;
   case ValueTypes::Null: return 0.0;
-  case ValueTypes::Num:  return std::get<double>(_vlu);
-  case ValueTypes::Str:  return std::stod(std::get<std::string>(_vlu));
-  case ValueTypes::List: return std::get<std::vector<Value>>(_vlu).size();
+  case ValueTypes::Num: {
+    double vlu;
+    std::memcpy(&vlu, &_bits, sizeof(vlu));
+    return vlu;
+  }
+  case ValueTypes::Str:  return std::stod(str());
+  case ValueTypes::List: return listSize();
   }
   return 0.0;
 }
 
+std::string_view Value::strView() const
+{
+  if (isStr())
+    return str();
+  return std::string_view{};
+}
+
+ListView Value::listView() const
+{
+  if (isList())
+    return ListView{listData(), listSize()};
+  return ListView{this, 1};
+}
+
 std::vector<Value> Value::asList() const
 {
-  switch(_type) {
+  switch(type()) {
   case ValueTypes::Bool:
   case ValueTypes::Null:
   case ValueTypes::Num:  [[fallthrough]];
   case ValueTypes::Str:  return std::vector<Value>{*this};
-  case ValueTypes::List: return std::get<std::vector<Value>>(_vlu);
+  case ValueTypes::List:
+    return std::vector<Value>(listData(), listData() + listSize());
   }
   return std::vector<Value>{};
 }
 
 std::string Value::asStr() const
 {
-  switch (_type) {
+  switch (type()) {
   case ValueTypes::Bool:
-    return std::get<bool>(_vlu) ? "true" : "false";
+    return asBool() ? "true" : "false";
   case ValueTypes::Null:
     return "null";
   case ValueTypes::Num:{
     // floating points i C++ is a mess, puh...
-    auto vlu = std::to_string(std::get<double>(_vlu));
+    auto vlu = std::to_string(asNum());
     auto dotPos = vlu.find_first_of('.');
-    vlu.erase(vlu.find_last_not_of('0', dotPos) + 1, std::string::npos);
-    if (vlu.size()-1 == dotPos)
-      vlu.erase(dotPos, std::string::npos);
+    if (dotPos != std::string::npos) {
+      vlu.erase(vlu.find_last_not_of('0') + 1, std::string::npos);
+      if (vlu.size()-1 == dotPos)
+        vlu.erase(dotPos, std::string::npos);
+    }
     return vlu;
   }
   case ValueTypes::Str:
-    return std::get<std::string>(_vlu);
+    return str();
   case ValueTypes::List: {
     std::vector<std::string> parts;
-    for (const auto& itm : std::get<std::vector<Value>>(_vlu))
-      parts.emplace_back(itm.asStr());
+    auto items = listData();
+    for (std::size_t i = 0; i < listSize(); ++i)
+      parts.emplace_back(items[i].asStr());
     return std::string("[") + join(parts, ", ") + "]";
   }
   }
@@ -280,31 +595,14 @@ std::string Value::asStr() const
 
 const Value& Value::at(std::size_t idx) const
 {
-  if (isList()) {
-    auto& l = std::get<std::vector<Value>>(_vlu);
-    if (l.size() > idx)
-      return l[idx];
-  }
+  if (isList() && listSize() > idx)
+    return listData()[idx];
   return Value::Null;
 }
 
 Value Value::clone() const
 {
-  switch (_type) {
-  case ValueTypes::Null: return Value::Null;
-  case ValueTypes::Bool: return Value(std::get<bool>(_vlu));
-  case ValueTypes::Num:  return Value(std::get<double>(_vlu));
-  case ValueTypes::Str:  return Value(std::get<std::string>(_vlu));
-  case ValueTypes::List: {
-    const auto& me = std::get<std::vector<Value>>(_vlu);
-    std::vector<Value> list;
-    list.reserve(me.size());
-    for(const auto& itm : me)
-      list.emplace_back(itm.clone());
-    return Value(list);
-  }
-  }
-  return Value::Null;
+  return *this;
 }
 
 Value Value::from_str(std::string str)
@@ -318,10 +616,47 @@ Value Value::from_str(std::string str)
   if (end == str.data()+str.size())
     // successfully converted
     return Value(dVlu);
-  return Value(std::string(str));
+  return Value(std::move(str));
+}
+
+const Value Value::Null{};
+
+// ---------------------------------------------------
+
+Immortals::Immortals() :
+  _objs{}, _bufs{}
+{}
+
+Immortals::~Immortals()
+{
+  // the items of the buffers are released while the objects remain
+  for (auto buf : _bufs)
+    delete buf;
+  for (auto obj : _objs) {
+    if (obj->type == ValueTypes::Str)
+      delete static_cast<StrObj*>(obj);
+    else
+      delete static_cast<ListObj*>(obj);
+  }
 }
 
-std::shared_ptr<Value> Value::Null_ptr{new Value};
-Value& Value::Null = *Null_ptr;
+void Immortals::add(const Value& value)
+{
+  if (!value.isPtr() || value.obj()->refs == HeapObj::Immortal)
+    return;
+  auto obj = value.obj();
+  obj->refs = HeapObj::Immortal;
+  _objs.emplace_back(obj);
+  if (obj->type != ValueTypes::List)
+    return;
+  // the whole buffer, its items are reached by slices of it
+  auto buf = static_cast<ListObj*>(obj)->buf;
+  if (buf->refs == HeapObj::Immortal)
+    return;
+  buf->refs = HeapObj::Immortal;
+  _bufs.emplace_back(buf);
+  for (const auto& item : buf->items)
+    add(item);
+}
 
 } // namespace atto
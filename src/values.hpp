@@ -1,46 +1,122 @@
 #ifndef ATTO_VALUES_H
 #define ATTO_VALUES_H
 
+#include <cstdint>
 #include <string_view>
 #include <string>
 #include <vector>
-#include <variant>
 #include <memory>
 #include "lex.hpp"
 
 namespace atto {
 
 /// @brief All different types a Value can have
-enum class ValueTypes {
+enum class ValueTypes : std::uint8_t {
   Num, Str, Bool, List, Null
 };
 
+/**
+ * @brief Header for values that does not fit inside a Value,
+ * such as strings and lists. Reference counted, freed by the
+ * last Value pointing to it.
+ */
+struct HeapObj {
+  /// refs of one that is not counted, see Immortals
+  static constexpr std::uint32_t Immortal = ~std::uint32_t{0};
+  std::uint32_t refs;
+  ValueTypes type;
+};
+
+/// @brief Shared storage for list items, a list value is a slice of this
+struct ListBuf;
+
+class ListView;
+
 /**
  * @brief The value class, all values in wm comes from here
+ *
+ * A Value is a NaN-boxed 64 bit word. Numbers are stored as plain
+ * doubles, any other type lives in the payload of a quiet NaN:
+ *   - null, true and false as small constants
+ *   - strings and lists as a pointer to a HeapObj
+ *
+ * Values are immutable. Lists are slices of a shared ListBuf, so tail
+ * is O(1) and fuse appends in place when the left side is the newest
+ * slice of its buffer.
  */
 class Value {
+  friend class Immortals;
 protected:
-  ValueTypes _type;
-  std::variant<
-    double, std::string, bool, std::vector<Value>, void*> _vlu;
+  std::uint64_t _bits;
+
+  static constexpr std::uint64_t SignBit  = 0x8000000000000000;
+  static constexpr std::uint64_t QNaN     = 0x7FFC000000000000;
+  static constexpr std::uint64_t PtrTag   = SignBit | QNaN;
+  static constexpr std::uint64_t PtrMask  = 0x0000FFFFFFFFFFFF;
+  static constexpr std::uint64_t NullBits  = QNaN | 1;
+  static constexpr std::uint64_t FalseBits = QNaN | 2;
+  static constexpr std::uint64_t TrueBits  = QNaN | 3;
+  /// every NaN gets stored as this, to not be taken for a boxed value
+  static constexpr std::uint64_t CanonicalNaN = 0x7FF8000000000000;
+
+  explicit Value(HeapObj* obj);
+  static std::uint64_t boxNum(double value);
+  static Value slice(ListBuf* buf, std::size_t begin, std::size_t size);
+  /// @brief Find out if a list among the items of the buffer of this
+  /// list, at any depth, is a slice of buf
+  bool holds(const ListBuf* buf) const;
+
+  bool isPtr() const { return (_bits & PtrTag) == PtrTag; }
+  HeapObj* obj() const {
+    return reinterpret_cast<HeapObj*>(_bits & PtrMask);
+  }
+  void retain() const {
+    if (isPtr() && obj()->refs != HeapObj::Immortal)
+      ++obj()->refs;
+  }
+  void release() {
+    if (isPtr() && obj()->refs != HeapObj::Immortal && --obj()->refs == 0)
+      destroy();
+  }
+  void destroy();
+  const std::string& str() const;
+  const Value* listData() const;
+  std::size_t listSize() const;
+
 public:
-  Value(const Value& other);
+  /// copies share the payload, O(1)
+  Value(const Value& other) : _bits{other._bits} { retain(); }
   Value(const Token& tok);
-  Value(Value&& rhs);
+  /// moves steal the payload, O(1)
+  Value(Value&& rhs) noexcept : _bits{rhs._bits} { rhs._bits = NullBits; }
   /// Create a null value
-  Value(); // null
+  constexpr Value() : _bits{NullBits} {} // null
   /// Create a Number value
   Value(double value);
   /// Create a boolean value
-  Value(bool value);
+  Value(bool value) : _bits{value ? TrueBits : FalseBits} {}
   /// create a string Value
   Value(std::string_view value);
-  /// create a list value
+  /// create a string Value, taking ownership of value
+  Value(std::string value);
+  /// create a list value, taking ownership of the items
   Value(std::vector<Value> value);
-  virtual ~Value();
+  ~Value() { release(); }
 
-  Value& operator=(const Value& other);
-  Value& operator=(Value&& rhs);
+  Value& operator=(const Value& other) {
+    other.retain();
+    release();
+    _bits = other._bits;
+    return *this;
+  }
+  Value& operator=(Value&& rhs) noexcept {
+    if (this != &rhs) {
+      release();
+      _bits = rhs._bits;
+      rhs._bits = NullBits;
+    }
+    return *this;
+  }
   bool operator==(const Value& other) const;
   bool operator>(const Value& other) const;
   bool operator>=(const Value& other) const;
@@ -52,6 +128,26 @@ public:
   Value operator!() const;
   /// make a number negative +1 => -1
   Value neg() const;
+  /// first item in a list or first letter in a string, null for empty list
+  Value head() const;
+  /// all but the first item in a list or letter in a string
+  Value tail() const;
+  /// join this and other into one list
+  Value fuse(const Value& other) const;
+
+  // these behave as the recursive definitions in core.at did,
+  // but without the recursion
+
+  /// number of items in a list or letters in a string, 1 for atoms
+  Value len() const;
+  /// the n:th tail of a list or string, a slice for lists
+  Value skip(const Value& n) const;
+  /// the n:th item of a list or letter of a string
+  Value nth(const Value& n) const;
+  /// true if this is a list with an item equal to x
+  Value contains(const Value& x) const;
+  /// split this list into two lists at idx
+  Value split(const Value& idx) const;
 
   /// what type this value has
   ValueTypes type() const;
@@ -63,27 +159,71 @@ public:
   double asNum() const;
   /// get value as string
   std::string asStr() const;
+  /// borrow the characters of a string, empty for other types
+  std::string_view strView() const;
   /// get values as list
   std::vector<Value> asList() const;
+  /// borrow the items of a list without copying, same items as asList
+  ListView listView() const;
   /// get the value at index in a list
   const Value& at(std::size_t idx) const;
-  /// clone this value
+  /// clone this value, values are immutable so the payload is shared
   Value clone() const;
 
-  bool isNull() const { return _type == ValueTypes::Null; }
-  bool isNum()  const { return _type == ValueTypes::Num; }
-  bool isBool() const { return _type == ValueTypes::Bool; }
-  bool isStr()  const { return _type == ValueTypes::Str; }
-  bool isList() const { return _type == ValueTypes::List; }
+  bool isNull() const { return _bits == NullBits; }
+  bool isNum()  const { return (_bits & QNaN) != QNaN; }
+  bool isBool() const { return _bits == TrueBits || _bits == FalseBits; }
+  bool isStr()  const { return isPtr() && obj()->type == ValueTypes::Str; }
+  bool isList() const { return isPtr() && obj()->type == ValueTypes::List; }
 
   /// read value from a string suh as token from source code
   static Value from_str(std::string str);
 
-  /// a global Null value
-  static Value& Null;
-  static std::shared_ptr<Value> Null_ptr;
+  /// a Null value, it owns nothing so all threads may share it
+  static const Value Null;
 };
 
+/**
+ * @brief A borrowed view of the items in a list, no copies are made.
+ * Only valid as long as the Value it was taken from is alive.
+ */
+class ListView {
+  const Value* _begin;
+  std::size_t _size;
+public:
+  ListView(const Value* begin, std::size_t size) :
+    _begin{begin}, _size{size}
+  {}
+  const Value* begin() const { return _begin; }
+  const Value* end() const { return _begin + _size; }
+  std::size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+  const Value& operator[](std::size_t idx) const { return _begin[idx]; }
+  const Value& front() const { return *_begin; }
+};
+
+/**
+ * @brief Values whose references are no longer counted, so any number
+ * of threads may copy them at once, such as the constants of a Program.
+ * What a list refers to becomes immortal with it, and its buffer is
+ * not appended to in place anymore.
+ * They are freed when this is, copies of them must not outlive it.
+ */
+class Immortals {
+  std::vector<HeapObj*> _objs;
+  std::vector<ListBuf*> _bufs;
+public:
+  Immortals();
+  Immortals(const Immortals& other) = delete;
+  ~Immortals();
+  Immortals& operator=(const Immortals& other) = delete;
+
+  /// @brief Stop counting references to value, call before it is shared
+  void add(const Value& value);
+};
+
+static_assert(sizeof(Value) == 8, "Value should be a single 64 bit word");
+
 } // namespace atto
 
 #endif // ATTO_VALUES_H
@@ -3,6 +3,8 @@
 #include "lib/linenoise.hpp"
 #include "ast.hpp"
 #include "parser.hpp"
+#include "errors.hpp"
+#include "isolate.hpp"
 #include <iostream>
 
 //#define DEBUG(x) do { std::cerr << x; } while (0)
@@ -10,8 +12,68 @@
 
 namespace atto {
 
-Vm::Vm() {}
-Vm::~Vm() {}
+namespace {
+
+/// destroy the values in [to, top), top ends up at to
+void unwind(Value*& top, Value* to)
+{
+  while (top > to)
+    (--top)->~Value();
+}
+
+/// restores the stack when we leave, even by an exception
+struct StackGuard {
+  Value*& top;
+  Value* bottom;
+  ~StackGuard() { unwind(top, bottom); }
+};
+
+/// counts a nested call until we leave it
+struct DepthGuard {
+  std::size_t& depth;
+  ~DepthGuard() { --depth; }
+};
+
+/// @brief Find out if fn does nothing but evaluate to its last argument,
+/// as '# x y' does
+bool passesLastArg(const AstFunc& fn)
+{
+  auto nargs = fn.args().size();
+  if (nargs == 0)
+    return false;
+  try {
+    const auto& body = fn.body();
+    return body.size() == 1 && body[0]->type() == LangType::Ident &&
+      static_cast<const AstIdent*>(body[0])->localIdx() == nargs - 1;
+  } catch (const SyntaxError&) {
+    // leave the error to the call, after its arguments are evaluated
+    return false;
+  }
+}
+
+} // namespace
+
+Vm::Vm(Engine engine) :
+  _engine{engine},
+  // raw memory, pages are not touched until the stack grows into them
+  _stack{static_cast<Value*>(::operator new(StackSize * sizeof(Value)))},
+  _stackEnd{_stack + StackSize},
+  _top{_stack},
+  _frames{new Frame[MaxFrames]},
+  _evalDepth{0},
+  _evalBase{0}
+{}
+
+Vm::~Vm()
+{
+  unwind(_top, _stack);
+  ::operator delete(_stack);
+}
+
+Vm::Engine Vm::engine() const
+{
+  return _engine;
+}
 
 
 void Vm::print(std::string_view msg) const
@@ -26,175 +88,399 @@ Value Vm::input(std::string_view msg) const
   return Value(str);
 }
 
-std::shared_ptr<const Value> Vm::eval(
-  const AstBase& astNode,
-  const std::unordered_map<std::string, FuncDef>& funcs,
-  const std::vector<std::shared_ptr<const Value>>& args
-) {
+Value Vm::call(const AstFunc& fn, const std::vector<Value>& args)
+{
+  if (_engine == Engine::Bytecode)
+    return run(fn, args);
+
+  StackGuard guard{_top, _top};
+  if (args.size() > StackSize)
+    throw RuntimeError("Stack overflow", fn.module());
+  auto base = _top;
+  for (const auto& arg : args)
+    new (_top++) Value(arg);
+  return invoke(fn, base);
+}
+
+Value* Vm::pushArgs(const AstBase& call, const AstFunc& fn, const Value* args)
+{
+  const auto& params = call.children();
+  if (_top + params.size() > _stackEnd)
+    throw RuntimeError(
+      "Stack overflow when calling '" + std::string(fn.fnName()) + "'",
+      fn.module());
+  // arguments goes on the vm stack, they are the frame of fn
+  auto base = _top;
+  for (const auto& e : params) {
+    auto vlu = eval(*e, args);
+    new (_top++) Value(std::move(vlu));
+  }
+  return base;
+}
+
+Value Vm::invoke(const AstFunc& fn, Value* base)
+{
+  // each nested call uses the C++ stack, stop long before it ends
+  char here;
+  auto pos = reinterpret_cast<std::uintptr_t>(&here);
+  if (_evalDepth++ == 0)
+    _evalBase = pos;
+  DepthGuard guard{_evalDepth};
+  auto used = pos < _evalBase ? _evalBase - pos : pos - _evalBase;
+  if (used > MaxEvalStack)
+    throw RuntimeError(
+      "Stack overflow when calling '" + std::string(fn.fnName()) + "'",
+      fn.module());
+
+  for (auto func = &fn;;) {
+    DEBUG("Entering fn " << func->fnName()
+              << " " << func->args().size() << " args\n");
+    const auto& body = func->body();
+    if (body.empty())
+      return Value();
+    for (std::size_t i = 0; i + 1 < body.size(); ++i)
+      eval(*body[i], base);
+
+    // the last expression is in tail position, so are the branches of
+    // if and the last argument to '# x y' and the like
+    auto expr = body.back();
+    const AstFunc* callee = nullptr;
+    for (;;) {
+      if (expr->type() == LangType::If) {
+        expr = eval((*expr)[0], base).asBool() ? &(*expr)[1] : &(*expr)[2];
+        continue;
+      }
+      if (expr->type() != LangType::Call)
+        return eval(*expr, base);
+      auto call = static_cast<const AstCall*>(expr);
+      callee = &Isolate::current().funcById(call->funcId());
+      if (!passesLastArg(*callee))
+        break;
+      const auto& params = expr->children();
+      for (std::size_t i = 0; i + 1 < params.size(); ++i)
+        eval(*params[i], base);
+      expr = params.back();
+    }
+
+    // the arguments of the callee replace ours, as OpCode::TailCall
+    func = callee;
+    auto from = pushArgs(*expr, *func, base);
+    auto nargs = static_cast<std::size_t>(_top - from);
+    for (std::size_t i = 0; i < nargs; ++i)
+      base[i] = std::move(from[i]);
+    unwind(_top, base + nargs);
+  }
+}
+
+Value Vm::run(const AstFunc& fn, const std::vector<Value>& args)
+{
+  const auto& isolate = Isolate::current();
+  Value* sp = _stack;
+  StackGuard guard{sp, _stack};
+  Frame* frame = _frames.get();
+  Frame* const framesEnd = frame + MaxFrames;
+
+  auto overflow = [&](const AstFunc& fn) {
+    return RuntimeError(
+      "Stack overflow when calling '" + std::string(fn.fnName()) + "'",
+      fn.module());
+  };
+  auto push = [&](Value v) { new (sp++) Value(std::move(v)); };
+  auto pop = [&]() -> Value {
+    Value v{std::move(*--sp)};
+    sp->~Value();
+    return v;
+  };
+
+  if (args.size() + fn.code().maxStack() > StackSize)
+    throw overflow(fn);
+  for (const auto& arg : args)
+    push(arg);
+  *frame = {&fn.code(), fn.code().code(), _stack};
+
+  for (;;) {
+    const Instr ins = *frame->pc++;
+    switch (Chunk::opOf(ins)) {
+    case OpCode::Const:
+      push(frame->chunk->constant(Chunk::argOf(ins)));
+      break;
+    case OpCode::Arg:
+      push(frame->base[Chunk::argOf(ins)]);
+      break;
+    case OpCode::Pop:
+      (--sp)->~Value();
+      break;
+    case OpCode::Jump:
+      frame->pc = frame->chunk->code() + Chunk::argOf(ins);
+      break;
+    case OpCode::JumpIfNot:
+      if (!pop().asBool())
+        frame->pc = frame->chunk->code() + Chunk::argOf(ins);
+      break;
+    case OpCode::Call: {
+      const auto& fn = isolate.funcById(Chunk::argOf(ins));
+      const auto& chunk = fn.code();
+      if (frame + 1 == framesEnd || sp + chunk.maxStack() > _stackEnd)
+        throw overflow(fn);
+      // the arguments are already in place, they become the new frame
+      *++frame = {&chunk, chunk.code(), sp - fn.args().size()};
+    } break;
+    case OpCode::TailCall: {
+      const auto& fn = isolate.funcById(Chunk::argOf(ins));
+      const auto& chunk = fn.code();
+      auto nargs = fn.args().size();
+      if (frame->base + nargs + chunk.maxStack() > _stackEnd)
+        throw overflow(fn);
+      // reuse the current frame, move arguments down to its base
+      auto from = sp - nargs;
+      for (std::size_t i = 0; i < nargs; ++i)
+        frame->base[i] = std::move(from[i]);
+      unwind(sp, frame->base + nargs);
+      frame->chunk = &chunk;
+      frame->pc = chunk.code();
+    } break;
+    case OpCode::Return: {
+      Value result = pop();
+      unwind(sp, frame->base);
+      if (frame == _frames.get())
+        return result;
+      --frame;
+      push(std::move(result));
+    } break;
+    case OpCode::Head:
+      sp[-1] = sp[-1].head();
+      break;
+    case OpCode::Tail:
+      sp[-1] = sp[-1].tail();
+      break;
+    case OpCode::Neg:
+      sp[-1] = sp[-1].neg();
+      break;
+    case OpCode::Fuse: {
+      auto r = pop();
+      sp[-1] = sp[-1].fuse(r);
+    } break;
+    case OpCode::Pair: {
+      auto r = pop();
+      auto l = pop();
+      std::vector<Value> list; list.reserve(2);
+      list.emplace_back(std::move(l));
+      list.emplace_back(std::move(r));
+      push(std::move(list));
+    } break;
+    case OpCode::Eq: {
+      auto r = pop();
+      sp[-1] = Value(sp[-1] == r);
+    } break;
+    case OpCode::Add: {
+      auto r = pop();
+      sp[-1] = sp[-1] + r;
+    } break;
+    case OpCode::Mul: {
+      auto r = pop();
+      sp[-1] = sp[-1] * r;
+    } break;
+    case OpCode::Div: {
+      auto r = pop();
+      sp[-1] = sp[-1] / r;
+    } break;
+    case OpCode::Rem: {
+      auto r = pop();
+      sp[-1] = sp[-1] % r;
+    } break;
+    case OpCode::Less: {
+      auto r = pop();
+      sp[-1] = Value(r > sp[-1]);
+    } break;
+    case OpCode::LessEq: {
+      auto r = pop();
+      sp[-1] = Value(r >= sp[-1]);
+    } break;
+    case OpCode::Litr:
+      sp[-1] = Value::from_str(sp[-1].asStr());
+      break;
+    case OpCode::Str:
+      if (!sp[-1].isStr())
+        sp[-1] = Value(sp[-1].asStr());
+      break;
+    case OpCode::Words: {
+      if (!sp[-1].isStr()) {
+        sp[-1] = Value::Null;
+        break;
+      }
+      std::vector<Value> words;
+      for (const auto& s : utf8_words(sp[-1].asStr()))
+        words.emplace_back(s);
+      sp[-1] = Value(std::move(words));
+    } break;
+    case OpCode::Len:
+      sp[-1] = sp[-1].len();
+      break;
+    case OpCode::Skip: {
+      auto l = pop();
+      sp[-1] = l.skip(sp[-1]);
+    } break;
+    case OpCode::Nth: {
+      auto l = pop();
+      sp[-1] = l.nth(sp[-1]);
+    } break;
+    case OpCode::In: {
+      auto l = pop();
+      sp[-1] = l.contains(sp[-1]);
+    } break;
+    case OpCode::Split: {
+      auto l = pop();
+      sp[-1] = l.split(sp[-1]);
+    } break;
+    case OpCode::Wrap: {
+      std::vector<Value> list;
+      list.emplace_back(std::move(sp[-1]));
+      sp[-1] = Value(std::move(list));
+    } break;
+    case OpCode::Input:
+      sp[-1] = input(sp[-1].asStr());
+      break;
+    case OpCode::Print:
+      if (sp[-1].isStr())
+        print(sp[-1].strView());
+      else
+        print(sp[-1].asStr());
+      break;
+    }
+  }
+}
+
+Value Vm::eval(const AstBase& astNode, const Value* args)
+{
   switch (astNode.type()) {
   case LangType::If:
-    if (eval(astNode[0], funcs, args)->asBool())
-      return eval(astNode[1], funcs, args);
+    if (eval(astNode[0], args).asBool())
+      return eval(astNode[1], args);
     else
-      return eval(astNode[2], funcs, args);
+      return eval(astNode[2], args);
   case LangType::Eq:{
-    auto l = eval(astNode[0], funcs, args);
-    auto r = eval(astNode[1], funcs, args);
-    return std::make_shared<Value>(*l == *r);
+    auto l = eval(astNode[0], args);
+    auto r = eval(astNode[1], args);
+    return Value(l == r);
   }
   case LangType::Add:{
-    auto l = eval(astNode[0], funcs, args);
-    auto r = eval(astNode[1], funcs, args);
-    return std::make_shared<Value>(*l + *r);
-  }
-  case LangType::Neg:{
-    auto v = eval(astNode[0], funcs, args);
-    return std::make_shared<Value>(v->neg());
-  }
-  case LangType::Mul:
-    return std::make_shared<Value>(
-      *eval(astNode[0], funcs, args) *
-      *eval(astNode[1], funcs, args));
-  case LangType::Div:
-    return std::make_shared<Value>(
-      *eval(astNode[0], funcs, args) /
-      *eval(astNode[1], funcs, args));
-  case LangType::Rem:
-    return std::make_shared<Value>(
-      *eval(astNode[0], funcs, args) %
-      *eval(astNode[0], funcs, args));
-  case LangType::Less:
-    return std::make_shared<Value>(
-      *eval(astNode[1], funcs, args) >
-      *eval(astNode[0], funcs, args));
-  case LangType::LessEq:
-    return std::make_shared<Value>(
-      *eval(astNode[1], funcs, args) >=
-      *eval(astNode[0], funcs, args));
-  case LangType::Head: {
-    auto v = eval(astNode[0], funcs, args);
-    if (v->isList()){
-      auto vl = v->asList();
-      if (vl.empty())
-        return std::make_shared<Value>(std::move(std::vector<Value>{}));
-      return std::make_shared<Value>(vl.front().clone());
-    } else if (v->isStr()) {
-      return std::make_shared<Value>(utf8_substr(v->asStr(), 0, 1));
-    }
-    return std::make_shared<Value>(*v);
-  }
-  case LangType::Tail: {
-    auto v = eval(astNode[0], funcs, args);
-    if (v->isList()) {
-      const auto& l = v->asList();
-      std::vector<Value> list; list.reserve(l.size());
-      if (l.size() > 1) {
-        for (auto it = l.begin()+1; it!=l.end(); ++it)
-          list.emplace_back(it->clone());
-      }
-      return std::make_shared<Value>(std::move(list));
-    } else if (v->isStr()) {
-      const auto& s = v->asStr();
-      if (s.size() < 2) return Value::Null_ptr;
-      return std::make_shared<Value>(utf8_substr(v->asStr(), 1));
-    }
-    return std::make_shared<Value>(*v);
+    auto l = eval(astNode[0], args);
+    auto r = eval(astNode[1], args);
+    return l + r;
   }
+  case LangType::Neg:
+    return eval(astNode[0], args).neg();
+  case LangType::Mul:{
+    auto l = eval(astNode[0], args);
+    auto r = eval(astNode[1], args);
+    return l * r;
+  }
+  case LangType::Div:{
+    auto l = eval(astNode[0], args);
+    auto r = eval(astNode[1], args);
+    return l / r;
+  }
+  case LangType::Rem:{
+    auto l = eval(astNode[0], args);
+    auto r = eval(astNode[1], args);
+    return l % r;
+  }
+  case LangType::Less:{
+    auto l = eval(astNode[0], args);
+    auto r = eval(astNode[1], args);
+    return Value(r > l);
+  }
+  case LangType::LessEq:{
+    auto l = eval(astNode[0], args);
+    auto r = eval(astNode[1], args);
+    return Value(r >= l);
+  }
+  case LangType::Head:
+    return eval(astNode[0], args).head();
+  case LangType::Tail:
+    return eval(astNode[0], args).tail();
   case LangType::Fuse: {
-    std::vector<Value> list;
-    auto fill = [&](const Value& from){
-      if (from.isList()) {
-        auto flist = from.asList();
-        list.insert(list.end(), flist.begin(), flist.end());
-      } else
-        list.emplace_back(from);
-    };
-    fill(eval(astNode[0], funcs, args)->clone());
-    fill(eval(astNode[1], funcs, args)->clone());
-    return std::make_shared<Value>(list);
+    auto l = eval(astNode[0], args);
+    auto r = eval(astNode[1], args);
+    return l.fuse(r);
   }
   case LangType::Pair: {
     std::vector<Value> list; list.reserve(2);
-    list.emplace_back(*eval(astNode[0], funcs, args));
-    list.emplace_back(*eval(astNode[1], funcs, args));
-    return std::make_shared<Value>(list);
+    list.emplace_back(eval(astNode[0], args));
+    list.emplace_back(eval(astNode[1], args));
+    return Value(std::move(list));
   }
   case LangType::Words: {
-    auto e = eval(astNode[0], funcs, args);
-    if (!e->isStr()) return Value::Null_ptr;
+    auto e = eval(astNode[0], args);
+    if (!e.isStr()) return Value::Null;
     std::vector<Value> words;
-    for (const auto& s : utf8_words(e->asStr()))
+    for (const auto& s : utf8_words(e.asStr()))
       words.emplace_back(s);
-    return std::make_shared<Value>(words);
+    return Value(std::move(words));
+  }
+  case LangType::Len:
+    return eval(astNode[0], args).len();
+  case LangType::Skip: {
+    auto n = eval(astNode[0], args);
+    return eval(astNode[1], args).skip(n);
   }
-  case LangType::Litr: {
-    auto v = eval(astNode[0], funcs, args);
-    return std::make_shared<Value>(Value::from_str(v->asStr()));
+  case LangType::Nth: {
+    auto n = eval(astNode[0], args);
+    return eval(astNode[1], args).nth(n);
   }
-  case LangType::Input: {
-    auto e = eval(astNode[0], funcs, args);
-    return std::make_shared<Value>(input(e->asStr()));
+  case LangType::In: {
+    auto x = eval(astNode[0], args);
+    return eval(astNode[1], args).contains(x);
   }
+  case LangType::Split: {
+    auto idx = eval(astNode[0], args);
+    return eval(astNode[1], args).split(idx);
+  }
+  case LangType::Litr:
+    return Value::from_str(eval(astNode[0], args).asStr());
+  case LangType::Input:
+    return input(eval(astNode[0], args).asStr());
   case LangType::Print: {
-    auto e = eval(astNode[0], funcs, args);
-    print(e->asStr());
+    auto e = eval(astNode[0], args);
+    if (e.isStr())
+      print(e.strView());
+    else
+      print(e.asStr());
     return e;
   }
   case LangType::Call: {
     auto call = static_cast<const AstCall*>(&astNode);
-    std::string fnName = std::string(call->fnName());
-    if (call->module().hasFunc(fnName)) {
-      const auto& fn = call->module().func(fnName);
-      std::vector<std::shared_ptr<const Value>> params;
-      params.reserve(args.size());
-      for (const auto& e : astNode.children())
-        params.emplace_back(eval(*e, funcs, args));
-      return eval(fn, call->module().funcs(), params);
-    }
-    return Value::Null_ptr;
-  }
-  case LangType::Fn: {
-    auto fn = static_cast<const AstFunc*>(&astNode);
-    std::shared_ptr<const Value> last;
-    DEBUG("Entering fn " << fn->fnName()
-              << " " << join(fn->args(), ", ") << "\n");
-    for (const auto& e : fn->children())
-      last = eval(*e, funcs, args);
-    DEBUG("Leave fn " << fn->fnName() << " with value "
-              << last->asStr() << " type:" << last->typeName() << "\n");
-    return last;
-  }
-  case LangType::Null_litr: return Value::Null_ptr;
-  case LangType::Value: {
-    const auto& exprVlu = static_cast<const AstValue*>(&astNode);
-    return std::make_shared<Value>(exprVlu->value());
+    const auto& fn = Isolate::current().funcById(call->funcId());
+    auto base = pushArgs(astNode, fn, args);
+    auto result = invoke(fn, base);
+    unwind(_top, base);
+    return result;
   }
+  case LangType::Null_litr: return Value::Null;
+  case LangType::Value:
+    return static_cast<const AstValue*>(&astNode)->value();
   case LangType::Num_litr:{
     const auto& exprVlu = static_cast<const AstValue*>(&astNode);
-    return std::make_shared<Value>(exprVlu->value().asNum());
+    return Value(exprVlu->value().asNum());
   }
   case LangType::True_litr: case LangType::False_litr: {
     const auto& exprVlu = static_cast<const AstValue*>(&astNode);
-    return std::make_shared<Value>(exprVlu->value().asBool());
-  }
-  case LangType::Str_litr: {
-    const auto& exprVlu = static_cast<const AstValue*>(&astNode);
-    return std::make_shared<Value>(exprVlu->value().asStr());
-  }
-  case LangType::List:{
-    const auto& exprVlu = static_cast<const AstValue*>(&astNode);
-    return std::make_shared<Value>(exprVlu->value().asList());
+    return Value(exprVlu->value().asBool());
   }
+  case LangType::Str_litr:
+  case LangType::List:
+    return static_cast<const AstValue*>(&astNode)->value();
   case LangType::Str: {// convert to string
-    const auto e = eval(astNode[0], funcs, args);
-    return std::make_shared<Value>(e->asStr());
+    auto e = eval(astNode[0], args);
+    if (e.isStr())
+      return e;
+    return Value(e.asStr());
   }
   case LangType::Ident: {
     const auto& exprVlu = static_cast<const AstIdent*>(&astNode);
-    auto v = args[exprVlu->localIdx()];
     //DEBUG("Get ident " << expr.token().ident()
     //      << " vlu:" << v->asStr() << " type:" << v->typeName() << "\n");
-    return v;
+    return args[exprVlu->localIdx()];
   }
   /*case LangType::Import: {
     const auto e = eval(*astNode[0], funcs, args);
@@ -205,7 +491,7 @@ std::shared_ptr<const Value> Vm::eval(
   default:
     std::cerr <<
       "unhandled astNode.type():" << typeName(astNode.type()) << '\n';
-    return nullptr;
+    return Value::Null;
   }
 }
 
@@ -1,6 +1,7 @@
 #ifndef ATTO_VM_H
 #define ATTO_VM_H
 
+#include <cstdint>
 #include <memory>
 #include <vector>
 #include <unordered_map>
@@ -11,17 +12,71 @@
 namespace atto {
 
 class Vm {
+public:
+  /// @brief How functions get evaluated
+  enum class Engine {
+    Bytecode,  // compile to bytecode and run in the stack vm
+    TreeWalker // reference engine, walks the AST recursively
+  };
+
+  /// @brief Number of values on the stack, shared by all frames
+  static constexpr std::size_t StackSize = 1 << 20;
+  /// @brief Max number of nested non tail calls in the bytecode engine
+  static constexpr std::size_t MaxFrames = 1 << 18;
+  /// @brief Max bytes of C++ stack used by nested non tail calls in the
+  /// tree walker, half of what a thread gets by default
+  static constexpr std::size_t MaxEvalStack = 1 << 22;
+
+private:
+  /// @brief A call in progress, its arguments start at base
+  struct Frame {
+    const Chunk* chunk;
+    const Instr* pc;
+    Value* base;
+  };
+
+  Engine _engine;
+  // allocated once, slots from _top and up are not constructed
+  Value* _stack;
+  Value* _stackEnd;
+  Value* _top;
+  std::unique_ptr<Frame[]> _frames;
+  /// nested calls in the tree walker and where on the C++ stack the
+  /// outermost began
+  std::size_t _evalDepth;
+  std::uintptr_t _evalBase;
+
   void print(std::string_view msg) const;
   Value input(std::string_view msg) const;
   void import(Module& mod, std::filesystem::path path) const;
+  /// @brief Evaluate the parameters of call to fn onto the stack
+  /// @return Where they begin
+  Value* pushArgs(const AstBase& call, const AstFunc& fn, const Value* args);
+  /// @brief Evaluate the body of fn by walking the AST, calls in tail
+  /// position reuse the arguments at base instead of nesting
+  Value invoke(const AstFunc& fn, Value* base);
 public:
-  Vm();
+  Vm(Engine engine = Engine::Bytecode);
+  Vm(const Vm& other) = delete;
+  Vm& operator=(const Vm& other) = delete;
   ~Vm();
 
-  std::shared_ptr<const Value> eval(
-    const AstBase& expr,
-    const FuncMap& funcs,
-    const std::vector<std::shared_ptr<const Value>>& args);
+  /// @return The engine used by call()
+  Engine engine() const;
+
+  /// @brief Call fn with args using the selected engine
+  /// @param fn The function to call
+  /// @param args The arguments to fn
+  /// @return The value fn evaluated to
+  Value call(const AstFunc& fn, const std::vector<Value>& args = {});
+
+  /// @brief Run the compiled bytecode of fn
+  Value run(const AstFunc& fn, const std::vector<Value>& args);
+
+  /// @brief Evaluate expr by walking the AST, the reference engine
+  /// @param expr The expression to evaluate
+  /// @param args The arguments of the current function, on the vm stack
+  Value eval(const AstBase& expr, const Value* args);
 };
 
 } // namespace atto
@@ -0,0 +1,81 @@
+/**
+ * Writes the core library as C++ source, so it is built into the
+ * atto executable and loaded without lexing or parsing it, see
+ * core_image.hpp.
+ *
+ * Usage: atto_mkcore core.at core_image.cpp
+ */
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include "cache.hpp"
+#include "errors.hpp"
+#include "isolate.hpp"
+#include "modules.hpp"
+#include "parser.hpp"
+
+using namespace atto;
+
+namespace {
+
+void writeArray(std::ostream& out, std::string_view name,
+                std::string_view bytes)
+{
+  // the image is read as arrays of uint32
+  out << "alignas(8) const unsigned char " << name << "[] = {";
+  for (std::size_t i = 0; i < bytes.size(); ++i) {
+    out << (i % 16 == 0 ? "\n  " : " ") << "0x" << std::setw(2)
+        << (static_cast<unsigned>(bytes[i]) & 0xFF) << ',';
+  }
+  out << "\n  0\n};\n";
+}
+
+} // namespace
+
+int main(int argc, const char *argv[])
+{
+  if (argc != 3) {
+    std::cerr << "Usage: atto_mkcore core.at core_image.cpp\n";
+    return 1;
+  }
+
+  bool success = false;
+  auto code = readFile(argv[1], success);
+  if (!success)
+    return 1;
+  // loaded first as atto does, so its functions get the same FuncIds
+  Isolate isolate;
+  Isolate::Use use(isolate);
+  isolate.setParseMode(ParseMode::Eager);
+  ModuleCache::setDirectory("");
+  std::string image;
+  std::string_view source;
+  try {
+    auto& core = isolate.builtin("__core__", "core.at", code.view(), {});
+    source = core.code();
+    image = ModuleCache::image(core, outline(core));
+  } catch (SyntaxError& e) {
+    std::cerr << argv[1] << ":" << e.line() << ":" << e.col() << ": "
+              << e.what() << '\n';
+    return 1;
+  }
+
+  std::ofstream out(argv[2]);
+  out << "// generated by atto_mkcore from " << argv[1]
+      << ", do not edit\n\n"
+      << "#include \"core_image.hpp\"\n\n"
+      << "namespace {\n\n" << std::hex << std::setfill('0');
+  writeArray(out, "source", source);
+  writeArray(out, "image", image);
+  out << std::dec << "\n} // namespace\n\n"
+      << "std::string_view atto::coreSource()\n{\n"
+      << "  return {reinterpret_cast<const char*>(source), "
+      << source.size() << "};\n}\n\n"
+      << "std::string_view atto::coreImage()\n{\n"
+      << "  return {reinterpret_cast<const char*>(image), "
+      << image.size() << "};\n}\n";
+  return out ? 0 : 1;
+}